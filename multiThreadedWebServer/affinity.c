@@ -0,0 +1,147 @@
+//
+// affinity.c: CPU lists and the cache and memory topology of the CPUs.
+//
+// CPU lists are written the way the kernel writes them, e.g. "0-3,8,10-11".
+// The topology comes from sysfs: CPUs sharing a last level cache list each
+// other in cache/index<n>/shared_cpu_list, and a CPU's NUMA node shows up
+// as a node<n> link in its directory. Where sysfs has neither, all CPUs
+// are taken to be in one group.
+//
+
+#define _GNU_SOURCE
+#include "blg312e.h"
+#include "affinity.h"
+#include <sched.h>
+#include <dirent.h>
+
+#define CPU_DIR "/sys/devices/system/cpu/cpu%d"
+
+//
+// Puts the CPUs of list into cpus, in the order given, and returns how
+// many there are, or -1 if list is not a CPU list or names more than max
+//
+int affinityParse(const char *list, int *cpus, int max)
+{
+   const char *p = list;
+   char *end;
+   long first, last;
+   int n = 0;
+
+   while (1) {
+      first = last = strtol(p, &end, 10);
+      if (end == p || first < 0)
+         return -1;
+      p = end;
+      if (*p == '-') {
+         last = strtol(++p, &end, 10);
+         if (end == p || last < first)
+            return -1;
+         p = end;
+      }
+      if (last >= CPU_SETSIZE || n + (last - first + 1) > max)
+         return -1;
+      while (first <= last)
+         cpus[n++] = first++;
+      if (*p == '\0' || *p == '\n')
+         return n;
+      if (*p++ != ',')
+         return -1;
+   }
+}
+
+//
+// Puts the CPUs the process may run on into cpus, lowest first, and
+// returns how many there are
+//
+int affinityAllowed(int *cpus, int max)
+{
+   cpu_set_t set;
+   int cpu, n = 0;
+
+   if (sched_getaffinity(0, sizeof(set), &set) < 0)
+      unix_error("sched_getaffinity error");
+   for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+         cpus[n++] = cpu;
+   }
+   return n;
+}
+
+//
+// Reads the first line of a sysfs file into buf. Returns -1 if there is
+// no such file.
+//
+static int affinityRead(const char *path, char *buf, int size)
+{
+   FILE *f;
+   int rc = 0;
+
+   if ((f = fopen(path, "r")) == NULL)
+      return -1;
+   if (fgets(buf, size, f) == NULL)
+      rc = -1;
+   fclose(f);
+   return rc;
+}
+
+//
+// Returns the lowest CPU sharing the last level cache with cpu
+//
+static int affinityCache(int cpu)
+{
+   char path[MAXLINE], buf[MAXLINE];
+   int cpus[AFFINITY_MAXCPUS];
+   int index, level, best = 0, group = 0;
+
+   for (index = 0; ; index++) {
+      snprintf(path, sizeof(path), CPU_DIR "/cache/index%d/level", cpu, index);
+      if (affinityRead(path, buf, sizeof(buf)) < 0)
+         break;
+      if ((level = atoi(buf)) < best)
+         continue;
+      snprintf(path, sizeof(path), CPU_DIR "/cache/index%d/shared_cpu_list", cpu, index);
+      if (affinityRead(path, buf, sizeof(buf)) == 0 &&
+          affinityParse(buf, cpus, AFFINITY_MAXCPUS) > 0) {
+         best = level;
+         group = cpus[0];
+      }
+   }
+   return group;
+}
+
+//
+// Returns the NUMA node of cpu
+//
+static int affinityNode(int cpu)
+{
+   char path[MAXLINE];
+   struct dirent *entry;
+   DIR *dir;
+   int node = 0;
+
+   snprintf(path, sizeof(path), CPU_DIR, cpu);
+   if ((dir = opendir(path)) == NULL)
+      return 0;
+   while ((entry = readdir(dir)) != NULL) {
+      if (sscanf(entry->d_name, "node%d", &node) == 1)
+         break;
+   }
+   closedir(dir);
+   return entry != NULL ? node : 0;
+}
+
+//
+// Returns a number that CPUs have in common if they share a last level
+// cache (AFFINITY_L3) or a NUMA node (AFFINITY_NUMA), and no other CPU has
+//
+int affinityGroup(int cpu, int by)
+{
+   switch (by) {
+   case AFFINITY_L3:
+      return affinityCache(cpu);
+   case AFFINITY_NUMA:
+      return affinityNode(cpu);
+   default:
+      return 0;
+   }
+}
@@ -0,0 +1,14 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+/* What the workers sharing a queue have in common */
+enum { AFFINITY_NONE, AFFINITY_L3, AFFINITY_NUMA };
+
+/* Most CPUs in a list */
+#define AFFINITY_MAXCPUS 1024
+
+int affinityParse(const char *list, int *cpus, int max);
+int affinityAllowed(int *cpus, int max);
+int affinityGroup(int cpu, int by);
+
+#endif
@@ -0,0 +1,549 @@
+/*
+ * bench.c: Load generator and latency benchmark for the web server.
+ *
+ * Every thread drives its share of the connections with epoll. In closed
+ * loop mode (the default) each connection sends its next request as soon
+ * as the previous response is complete. With -r the load is open loop:
+ * requests are issued at the target rate no matter how the server keeps
+ * up, and latency is measured from the time a request was due rather than
+ * from when a connection was free to send it, so queueing is not hidden.
+ *
+ * Latencies are recorded in log-linear histograms (as in HdrHistogram)
+ * with about 1.5% precision.
+ *
+ * Usage: ./bench [options] <host> <port>
+ */
+#include "blg312e.h"
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_URIS 1024
+#define MAX_EVENTS 256
+#define RESP_HEAD 8192
+
+/* log-linear histogram of microseconds: 64 linear sub-buckets per power of two */
+#define SUB_BITS 6
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS (SUB_COUNT * 40)
+
+typedef struct {
+  long long counts[HIST_BUCKETS];
+  long long total;
+  long long max;
+  double sum;
+} hist_t;
+
+typedef struct {
+  char *uri;
+  int weight;
+} uri_t;
+
+enum { C_IDLE, C_CONNECTING, C_SENDING, C_READING };
+
+typedef struct {
+  int fd;                    /* -1 when closed */
+  int state;
+  char req[MAXLINE];
+  int reqlen, reqsent;
+  char head[RESP_HEAD];
+  int headlen;               /* bytes of the response head read so far */
+  long long body_left;       /* -1: until the server closes */
+  int server_close;
+  double start;              /* when the current request was due */
+} bconn_t;
+
+typedef struct {
+  int id;
+  int nconns;
+  double rate;               /* requests/s of this thread, 0 for closed loop */
+  pthread_t tid;
+  bconn_t *conns;
+  int epfd;
+  unsigned int seed;
+  double *due;               /* open loop: due times of requests waiting for a connection */
+  int ndue, capdue;
+  hist_t hist;
+  long long errors;
+  long long bytes;
+} worker_t;
+
+/* configuration */
+char *host;
+struct sockaddr_in server_addr;
+int nconns = 16;
+int nthreads = 1;
+double duration = 10;
+double target_rps = 0;
+int keepalive = 1;
+uri_t uris[MAX_URIS];
+int nuris;
+int total_weight;
+
+double deadline;
+
+double now_seconds()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Histogram
+ */
+int hist_index(long long v)
+{
+  int e = 0;
+
+  if (v < SUB_COUNT)
+    return v;
+  while ((v >> e) >= 2 * SUB_COUNT)
+    e++;
+  /* v >> e is in [SUB_COUNT, 2 * SUB_COUNT) */
+  int idx = (e + 1) * SUB_COUNT + (int)((v >> e) - SUB_COUNT);
+  return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+long long hist_value(int idx)
+{
+  int e;
+
+  if (idx < SUB_COUNT)
+    return idx;
+  e = idx / SUB_COUNT - 1;
+  /* middle of the bucket */
+  return ((long long)(idx % SUB_COUNT + SUB_COUNT) << e) + ((1LL << e) >> 1);
+}
+
+void hist_record(hist_t *h, long long v)
+{
+  h->counts[hist_index(v)]++;
+  h->total++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+void hist_merge(hist_t *to, hist_t *from)
+{
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    to->counts[i] += from->counts[i];
+  to->total += from->total;
+  to->sum += from->sum;
+  if (from->max > to->max)
+    to->max = from->max;
+}
+
+long long hist_percentile(hist_t *h, double p)
+{
+  long long rank = (long long)(p / 100.0 * h->total + 0.5), seen = 0;
+
+  if (rank < 1)
+    rank = 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return hist_value(i) < h->max ? hist_value(i) : h->max;
+  }
+  return h->max;
+}
+
+/*
+ * Workload
+ */
+void add_uri(char *uri, int weight)
+{
+  if (nuris == MAX_URIS)
+    app_error("too many URIs in workload");
+  uris[nuris].uri = strdup(uri);
+  uris[nuris].weight = weight;
+  total_weight += weight;
+  nuris++;
+}
+
+/*
+ * Reads a workload file: one "<weight> <uri>" per line, # starts a comment
+ */
+void read_workload(char *filename)
+{
+  char line[MAXLINE], uri[MAXLINE];
+  int weight;
+  FILE *f;
+
+  if ((f = fopen(filename, "r")) == NULL)
+    unix_error("cannot open workload");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%d %s", &weight, uri) != 2)
+      continue;
+    if (weight > 0)
+      add_uri(uri, weight);
+  }
+  fclose(f);
+}
+
+char *pick_uri(worker_t *w)
+{
+  int r = rand_r(&w->seed) % total_weight;
+
+  for (int i = 0; i < nuris; i++) {
+    if ((r -= uris[i].weight) < 0)
+      return uris[i].uri;
+  }
+  return uris[nuris - 1].uri;
+}
+
+/*
+ * Connections
+ */
+void conn_close(bconn_t *c)
+{
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+  c->state = C_IDLE;
+}
+
+void conn_watch(worker_t *w, bconn_t *c, int op, int events)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(w->epfd, op, c->fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+}
+
+void conn_error(worker_t *w, bconn_t *c)
+{
+  w->errors++;
+  conn_close(c);
+}
+
+/*
+ * Writes as much of the request as the socket takes
+ */
+void conn_send(worker_t *w, bconn_t *c)
+{
+  ssize_t n;
+
+  while (c->reqsent < c->reqlen) {
+    n = write(c->fd, c->req + c->reqsent, c->reqlen - c->reqsent);
+    if (n < 0) {
+      if (errno == EAGAIN) {
+        conn_watch(w, c, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+      }
+      conn_error(w, c);
+      return;
+    }
+    c->reqsent += n;
+  }
+  c->state = C_READING;
+  c->headlen = 0;
+  conn_watch(w, c, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * Starts a request that was due at the given time on an idle connection,
+ * connecting first if needed
+ */
+void conn_start(worker_t *w, bconn_t *c, double due)
+{
+  c->start = due;
+  c->reqlen = snprintf(c->req, sizeof(c->req), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                       pick_uri(w), host, keepalive ? "" : "Connection: close\r\n");
+  c->reqsent = 0;
+
+  if (c->fd >= 0) {
+    c->state = C_SENDING;
+    conn_send(w, c);
+    return;
+  }
+
+  if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    unix_error("socket error");
+  c->state = C_CONNECTING;
+  if (connect(c->fd, (SA *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+    conn_error(w, c);
+    return;
+  }
+  conn_watch(w, c, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+/*
+ * Returns the length of the response head, 0 if incomplete
+ */
+int head_length(char *buf, int len)
+{
+  for (int i = 3; i < len; i++) {
+    if (buf[i] == '\n' && buf[i-1] == '\r' && buf[i-2] == '\n' && buf[i-3] == '\r')
+      return i + 1;
+  }
+  return 0;
+}
+
+/*
+ * Looks at the response head for the body length and whether the server
+ * closes the connection after it
+ */
+void parse_head(bconn_t *c, int headlen)
+{
+  char *p;
+
+  c->head[headlen] = '\0';
+  c->body_left = -1;
+  c->server_close = !keepalive;
+  for (p = strstr(c->head, "\r\n"); p != NULL && p + 2 < c->head + headlen; p = strstr(p + 2, "\r\n")) {
+    if (strncasecmp(p + 2, "Content-Length:", 15) == 0)
+      c->body_left = atoll(p + 17);
+    else if (strncasecmp(p + 2, "Connection: close", 17) == 0)
+      c->server_close = 1;
+  }
+  /* no length, or the length comes from a CGI program after our head */
+  if (c->body_left < 0)
+    c->server_close = 1;
+}
+
+void conn_done(worker_t *w, bconn_t *c)
+{
+  double end = now_seconds();
+
+  hist_record(&w->hist, (long long)((end - c->start) * 1e6));
+  if (c->server_close)
+    conn_close(c);
+  else
+    c->state = C_IDLE;
+}
+
+void conn_read(worker_t *w, bconn_t *c)
+{
+  char buf[1 << 16];
+  ssize_t n;
+  int headlen;
+
+  while (1) {
+    if (c->headlen >= 0) {
+      /* still reading the head */
+      n = read(c->fd, c->head + c->headlen, RESP_HEAD - 1 - c->headlen);
+    } else {
+      n = read(c->fd, buf, c->body_left >= 0 && c->body_left < sizeof(buf) ? c->body_left : sizeof(buf));
+    }
+    if (n < 0) {
+      if (errno != EAGAIN)
+        conn_error(w, c);
+      return;
+    }
+    if (n == 0) {
+      if (c->headlen < 0 && c->body_left < 0)
+        conn_done(w, c);   /* body ended with the connection */
+      else
+        conn_error(w, c);
+      conn_close(c);
+      return;
+    }
+    w->bytes += n;
+
+    if (c->headlen >= 0) {
+      c->headlen += n;
+      if ((headlen = head_length(c->head, c->headlen)) == 0) {
+        if (c->headlen == RESP_HEAD - 1) {
+          conn_error(w, c);
+          return;
+        }
+        continue;
+      }
+      if (strncmp(c->head, "HTTP/1.1 200", 12) && strncmp(c->head, "HTTP/1.0 200", 12))
+        w->errors++;
+      parse_head(c, headlen);
+      /* body bytes that came with the head */
+      n = c->headlen - headlen;
+      c->headlen = -1;
+      if (c->body_left < 0)
+        continue;
+      c->body_left -= n;
+    } else if (c->body_left >= 0) {
+      c->body_left -= n;
+    }
+    if (c->body_left == 0) {
+      conn_done(w, c);
+      return;
+    }
+  }
+}
+
+/*
+ * Closed loop: every connection has a request outstanding all the time.
+ * Open loop: requests become due at the target rate and wait for an idle
+ * connection if there is none.
+ */
+void *worker(void *arg)
+{
+  worker_t *w = (worker_t*)arg;
+  struct epoll_event events[MAX_EVENTS];
+  double now, next_due, interval = 0;
+  int i, n;
+
+  if ((w->epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  w->conns = (bconn_t*)calloc(w->nconns, sizeof(bconn_t));
+  for (i = 0; i < w->nconns; i++) {
+    w->conns[i].fd = -1;
+    w->conns[i].state = C_IDLE;
+  }
+
+  now = now_seconds();
+  next_due = now;
+  if (w->rate > 0)
+    interval = 1.0 / w->rate;
+
+  while ((now = now_seconds()) < deadline) {
+    if (w->rate > 0) {
+      /* requests that became due since the last round */
+      for (; next_due <= now; next_due += interval) {
+        if (w->ndue == w->capdue) {
+          w->capdue = w->capdue ? 2 * w->capdue : 1024;
+          w->due = (double*)realloc(w->due, sizeof(double) * w->capdue);
+        }
+        w->due[w->ndue++] = next_due;
+      }
+    }
+    int head = 0;
+    for (i = 0; i < w->nconns; i++) {
+      if (w->conns[i].state != C_IDLE)
+        continue;
+      if (w->rate == 0)
+        conn_start(w, &w->conns[i], now);
+      else if (head < w->ndue)
+        conn_start(w, &w->conns[i], w->due[head++]);
+    }
+    if (head > 0) {
+      memmove(w->due, w->due + head, sizeof(double) * (w->ndue - head));
+      w->ndue -= head;
+    }
+
+    int timeout = 100;
+    if (w->rate > 0) {
+      timeout = (int)((next_due - now) * 1000);
+      if (timeout < 0)
+        timeout = 0;
+      if (timeout > 100)
+        timeout = 100;
+    }
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+    for (i = 0; i < n; i++) {
+      bconn_t *c = (bconn_t*)events[i].data.ptr;
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      switch (c->state) {
+      case C_CONNECTING:
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+          conn_error(w, c);
+          break;
+        }
+        c->state = C_SENDING;
+        /* fall through */
+      case C_SENDING:
+        conn_send(w, c);
+        break;
+      case C_READING:
+        conn_read(w, c);
+        break;
+      case C_IDLE:
+        /* the server closed a kept-alive connection */
+        conn_close(c);
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < w->nconns; i++)
+    conn_close(&w->conns[i]);
+  return NULL;
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [options] <host> <port>\n", prog);
+  fprintf(stderr, "  -c <conns>    concurrent connections (default 16)\n");
+  fprintf(stderr, "  -t <threads>  client threads (default 1)\n");
+  fprintf(stderr, "  -d <seconds>  test duration (default 10)\n");
+  fprintf(stderr, "  -r <rps>      open loop at this many requests/s (default closed loop)\n");
+  fprintf(stderr, "  -k <0|1>      reuse connections with keep-alive (default 1)\n");
+  fprintf(stderr, "  -u <uri>      request this URI (default /)\n");
+  fprintf(stderr, "  -w <file>     workload file with \"<weight> <uri>\" lines\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  struct hostent *hp;
+  worker_t *workers;
+  hist_t hist;
+  long long errors = 0, bytes = 0;
+  double start, elapsed;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:t:d:r:k:u:w:")) != -1) {
+    switch (opt) {
+    case 'c': nconns = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'r': target_rps = atof(optarg); break;
+    case 'k': keepalive = atoi(optarg); break;
+    case 'u': add_uri(optarg, 1); break;
+    case 'w': read_workload(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || nconns <= 0 || nthreads <= 0 || duration <= 0)
+    usage(argv[0]);
+  if (nthreads > nconns)
+    nthreads = nconns;
+  if (nuris == 0)
+    add_uri("/", 1);
+
+  host = argv[optind];
+  hp = Gethostbyname(host);
+  bzero(&server_addr, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  bcopy(hp->h_addr, &server_addr.sin_addr.s_addr, hp->h_length);
+  server_addr.sin_port = htons(atoi(argv[optind + 1]));
+
+  signal(SIGPIPE, SIG_IGN);
+
+  workers = (worker_t*)calloc(nthreads, sizeof(worker_t));
+  start = now_seconds();
+  deadline = start + duration;
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    workers[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+    workers[i].rate = target_rps / nthreads;
+    workers[i].seed = 12345 + i;
+    pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+  }
+
+  memset(&hist, 0, sizeof(hist));
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    hist_merge(&hist, &workers[i].hist);
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+  }
+  elapsed = now_seconds() - start;
+
+  printf("%s loop, %d connections, %d threads, keep-alive %s, %.1f s\n",
+         target_rps > 0 ? "open" : "closed", nconns, nthreads, keepalive ? "on" : "off", elapsed);
+  if (target_rps > 0)
+    printf("target:     %.1f requests/s\n", target_rps);
+  printf("requests:   %lld (%lld errors)\n", hist.total, errors);
+  printf("throughput: %.1f requests/s, %.2f MB/s\n", hist.total / elapsed, bytes / elapsed / (1 << 20));
+  if (hist.total > 0) {
+    printf("latency:    mean %.0f us, max %lld us\n", hist.sum / hist.total, hist.max);
+    printf("            p50 %lld us, p90 %lld us, p99 %lld us, p99.9 %lld us\n",
+           hist_percentile(&hist, 50), hist_percentile(&hist, 90),
+           hist_percentile(&hist, 99), hist_percentile(&hist, 99.9));
+  }
+  return 0;
+}
@@ -161,6 +161,15 @@ void Fstat(int fd, struct stat *buf)
         unix_error("Fstat error");
 }
 
+int Fcntl(int fd, int cmd, int arg) 
+{
+    int rc;
+
+    if ((rc = fcntl(fd, cmd, arg)) < 0)
+        unix_error("Fcntl error");
+    return rc;
+}
+
 /***************************************
  * Wrappers for memory mapping functions
  ***************************************/
@@ -179,6 +188,37 @@ void Munmap(void *start, size_t length)
         unix_error("munmap error");
 }
 
+/***************************************
+ * Wrappers for epoll functions
+ ***************************************/
+int Epoll_create1(int flags) 
+{
+    int rc;
+
+    if ((rc = epoll_create1(flags)) < 0)
+        unix_error("Epoll_create1 error");
+    return rc;
+}
+
+void Epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) 
+{
+    if (epoll_ctl(epfd, op, fd, event) < 0)
+        unix_error("Epoll_ctl error");
+}
+
+/* Returns 0 instead of failing when interrupted by a signal */
+int Epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) 
+{
+    int rc;
+
+    if ((rc = epoll_wait(epfd, events, maxevents, timeout)) < 0) {
+        if (errno != EINTR)
+            unix_error("Epoll_wait error");
+        rc = 0;
+    }
+    return rc;
+}
+
 /**************************** 
  * Sockets interface wrappers
  ****************************/
@@ -495,6 +535,18 @@ int open_clientfd(char *hostname, int port)
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_opts(port, 0, LISTENQ);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_opts - open_listenfd with SO_REUSEPORT if reuseport is
+ *     set, so several sockets can listen on port and the kernel spreads
+ *     new connections over them, and room for backlog connections that
+ *     have not been accepted yet.
+ */
+int open_listenfd_opts(int port, int reuseport, int backlog)
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -511,6 +563,11 @@ int open_listenfd(int port)
       fprintf(stderr, "setsockopt failed\n");
       return -1;
     }
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *)&optval , sizeof(int)) < 0) {
+      fprintf(stderr, "setsockopt failed\n");
+      return -1;
+    }
 
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -524,13 +581,12 @@ int open_listenfd(int port)
     }
 
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, backlog) < 0) {
       fprintf(stderr, "listen failed\n");
       return -1;
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /******************************************
  * Wrappers for the client/server helper routines 
@@ -557,4 +613,13 @@ int Open_listenfd(int port)
     return rc;
 }
 
+int Open_listenfd_opts(int port, int reuseport, int backlog)
+{
+    int rc;
+
+    if ((rc = open_listenfd_opts(port, reuseport, backlog)) < 0)
+        unix_error("Open_listenfd_opts error");
+    return rc;
+}
+
 
@@ -23,6 +23,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -82,11 +83,17 @@ int Select(int  n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 int Dup2(int fd1, int fd2);
 void Stat(const char *filename, struct stat *buf);
 void Fstat(int fd, struct stat *buf) ;
+int Fcntl(int fd, int cmd, int arg);
 
 /* Memory mapping wrappers */
 void *Mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
 void Munmap(void *start, size_t length);
 
+/* Epoll wrappers */
+int Epoll_create1(int flags);
+void Epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int Epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 /* Sockets interface wrappers */
 int Socket(int domain, int type, int protocol);
 void Setsockopt(int s, int level, int optname, const void *optval, int optlen);
@@ -116,9 +123,11 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_opts(int portno, int reuseport, int backlog);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_opts(int port, int reuseport, int backlog);
 
 #endif /* __CSAPP_H__ */
@@ -0,0 +1,219 @@
+//
+// cache.c: In-memory caches of static responses.
+//
+// Entries are keyed by filename and spread over independently locked
+// shards, each with its own LRU list and a share of the cache's budget.
+// An entry is only used while the file's size and modification time still
+// match the stat() taken for the request, so a changed file is reloaded.
+//
+
+#include "blg312e.h"
+#include "cache.h"
+#include "metrics.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024   /* hash buckets per shard */
+
+typedef struct {
+   pthread_mutex_t lock;
+   cache_entry_t *buckets[CACHE_BUCKETS];
+   cache_entry_t *lru_head, *lru_tail;
+   size_t used;
+} __attribute__((aligned(64))) cache_shard_t;
+
+struct cache {
+   cache_shard_t shards[CACHE_SHARDS];
+   size_t budget;
+};
+
+size_t cache_budget = 0;
+size_t cache_compressed_budget = 16 << 20;
+
+cache_t *cache_files, *cache_compressed;
+
+static cache_t *cacheNew(size_t budget)
+{
+   cache_t *cache = (cache_t*)aligned_alloc(64, sizeof(cache_t));
+
+   memset(cache, 0, sizeof(cache_t));
+   cache->budget = budget;
+   for (int i = 0; i < CACHE_SHARDS; i++) {
+      pthread_mutex_init(&cache->shards[i].lock, NULL);
+   }
+   return cache;
+}
+
+void cacheInit(void)
+{
+   cache_files = cacheNew(cache_budget);
+   cache_compressed = cacheNew(cache_compressed_budget);
+}
+
+// FNV-1a
+static unsigned int cacheHash(const char *key)
+{
+   unsigned int h = 2166136261u;
+
+   for (; *key; key++) {
+      h ^= (unsigned char)*key;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+//
+// Returns 1 if a response of this size may be cached at all
+//
+int cacheFits(cache_t *cache, size_t size)
+{
+   return cache != NULL && cache->budget > 0 && size <= cache->budget / CACHE_SHARDS;
+}
+
+static int cacheFresh(cache_entry_t *entry, struct stat *sbuf)
+{
+   return entry->size == sbuf->st_size &&
+           entry->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+static void cacheLruUnlink(cache_shard_t *shard, cache_entry_t *entry)
+{
+   if (entry->prev)
+      entry->prev->next = entry->next;
+   else
+      shard->lru_head = entry->next;
+   if (entry->next)
+      entry->next->prev = entry->prev;
+   else
+      shard->lru_tail = entry->prev;
+   entry->prev = entry->next = NULL;
+}
+
+static void cacheLruPush(cache_shard_t *shard, cache_entry_t *entry)
+{
+   entry->prev = NULL;
+   entry->next = shard->lru_head;
+   if (shard->lru_head)
+      shard->lru_head->prev = entry;
+   else
+      shard->lru_tail = entry;
+   shard->lru_head = entry;
+}
+
+void cacheRelease(cache_entry_t *entry)
+{
+   if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+      free(entry->key);
+      free(entry->header);
+      free(entry->body);
+      free(entry);
+   }
+}
+
+//
+// Returns the bucket of hash h in its shard. The low bits of h picked the
+// shard, so the bucket is taken from the bits above them.
+//
+static cache_entry_t **cacheBucket(cache_shard_t *shard, unsigned int h)
+{
+   return &shard->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+//
+// Removes entry from its shard and drops the cache's reference.
+// The shard must be locked.
+//
+static void cacheRemove(cache_shard_t *shard, cache_entry_t *entry)
+{
+   cache_entry_t **pp = cacheBucket(shard, cacheHash(entry->key));
+
+   while (*pp != entry)
+      pp = &(*pp)->hnext;
+   *pp = entry->hnext;
+   cacheLruUnlink(shard, entry);
+   shard->used -= entry->charge;
+   cacheRelease(entry);
+}
+
+//
+// Looks up key. Returns a referenced entry that matches the file described
+// by sbuf, or NULL. A stale entry is dropped.
+//
+cache_entry_t *cacheGet(cache_t *cache, const char *key, struct stat *sbuf)
+{
+   unsigned int h = cacheHash(key);
+   cache_shard_t *shard = &cache->shards[h % CACHE_SHARDS];
+   cache_entry_t *entry;
+
+   pthread_mutex_lock(&shard->lock);
+   for (entry = *cacheBucket(shard, h); entry; entry = entry->hnext) {
+      if (strcmp(entry->key, key) == 0)
+         break;
+   }
+   if (entry != NULL) {
+      if (cacheFresh(entry, sbuf)) {
+         cacheLruUnlink(shard, entry);
+         cacheLruPush(shard, entry);
+         atomic_fetch_add(&entry->refs, 1);
+      } else {
+         cacheRemove(shard, entry);
+         entry = NULL;
+      }
+   }
+   pthread_mutex_unlock(&shard->lock);
+   metricsAdd(entry != NULL ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
+   return entry;
+}
+
+//
+// Adds a response for key, taking ownership of the malloc'd header and
+// body, and evicts least recently used entries to stay within the shard's
+// share of the cache's budget. Returns a referenced entry; if another thread cached
+// the same version first, that entry is returned and ours is discarded.
+//
+cache_entry_t *cachePut(cache_t *cache, const char *key, struct stat *sbuf,
+                        char *header, int headerlen, char *body, size_t bodylen)
+{
+   unsigned int h = cacheHash(key);
+   cache_shard_t *shard = &cache->shards[h % CACHE_SHARDS];
+   cache_entry_t **bucket = cacheBucket(shard, h);
+   cache_entry_t *entry, *old;
+
+   entry = (cache_entry_t*)malloc(sizeof(cache_entry_t));
+   entry->key = strdup(key);
+   entry->mtime = sbuf->st_mtim;
+   entry->size = sbuf->st_size;
+   entry->header = header;
+   entry->headerlen = headerlen;
+   entry->body = body;
+   entry->bodylen = bodylen;
+   entry->charge = sizeof(cache_entry_t) + strlen(key) + headerlen + bodylen;
+   atomic_init(&entry->refs, 2);   // the cache's and the caller's
+   entry->prev = entry->next = NULL;
+
+   pthread_mutex_lock(&shard->lock);
+   for (old = *bucket; old; old = old->hnext) {
+      if (strcmp(old->key, key) == 0)
+         break;
+   }
+   if (old != NULL) {
+      if (cacheFresh(old, sbuf)) {
+         atomic_fetch_add(&old->refs, 1);
+         pthread_mutex_unlock(&shard->lock);
+         atomic_store(&entry->refs, 1);
+         cacheRelease(entry);
+         return old;
+      }
+      cacheRemove(shard, old);
+   }
+
+   while (shard->lru_tail != NULL && shard->used + entry->charge > cache->budget / CACHE_SHARDS)
+      cacheRemove(shard, shard->lru_tail);
+
+   entry->hnext = *bucket;
+   *bucket = entry;
+   cacheLruPush(shard, entry);
+   shard->used += entry->charge;
+   pthread_mutex_unlock(&shard->lock);
+   return entry;
+}
@@ -0,0 +1,44 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdatomic.h>
+
+/*
+ * A cached response: the pre-built header and the file contents.
+ * Entries are reference counted; the cache holds one reference while the
+ * entry is reachable and every cacheGet/cachePut caller holds one until it
+ * calls cacheRelease, so an entry can be evicted while it is being sent.
+ */
+typedef struct cache_entry {
+    char *key;
+    struct timespec mtime;   /* file version the entry was built from */
+    off_t size;              /* of the file, which the body may be compressed from */
+    char *header;
+    int headerlen;
+    char *body;
+    size_t bodylen;
+    size_t charge;           /* bytes counted against the budget */
+    atomic_int refs;
+
+    struct cache_entry *hnext;         /* hash chain */
+    struct cache_entry *prev, *next;   /* LRU list, most recent first */
+} cache_entry_t;
+
+typedef struct cache cache_t;
+
+/* Byte budgets of the caches below, 0 disables one */
+extern size_t cache_budget;
+extern size_t cache_compressed_budget;
+
+/* Files as they are, and text files compressed on the fly. Both are NULL,
+   and so never used, until cacheInit creates them. */
+extern cache_t *cache_files, *cache_compressed;
+
+void cacheInit(void);
+int cacheFits(cache_t *cache, size_t size);
+cache_entry_t *cacheGet(cache_t *cache, const char *key, struct stat *sbuf);
+cache_entry_t *cachePut(cache_t *cache, const char *key, struct stat *sbuf,
+                        char *header, int headerlen, char *body, size_t bodylen);
+void cacheRelease(cache_entry_t *entry);
+
+#endif
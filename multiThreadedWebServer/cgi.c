@@ -0,0 +1,664 @@
+//
+// cgi.c: Starts CGI programs and keeps pools of persistent ones.
+//
+// Worker threads never wait for a CGI program. They start it, or pass the
+// request to a pool process, and hand the client socket over to a reaper
+// thread. A classic child writes into a pipe, which the reaper moves to
+// the client socket with splice(2), and the child's pidfd tells the reaper
+// when to collect it. The reaper also watches the socket of every pool
+// process, and closes the client socket once the output of that
+// particular child ended or that pool process reports it is done. Either
+// way the server's part of the header is only sent once the program runs,
+// a pool process writing it itself ahead of its output, so a program that
+// cannot be started is answered 500.
+//
+
+#define _GNU_SOURCE
+#include "blg312e.h"
+#include "cgi.h"
+#include "metrics.h"
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define CGI_READY_TIMEOUT 2   // seconds a pool process may take to start
+#define CGI_MAXEVENTS 64
+#define CGI_RELAY_CHUNK (64 << 10)   // bytes moved by one splice
+
+// The server does only a little bit of the header.
+// The CGI program has to finish writing out the header,
+// and decides how long its body is, so the connection ends with it.
+static char cgi_header[] = "HTTP/1.1 200 OK\r\n"
+                           "Server: blg312e Web Server\r\n"
+                           "Connection: close\r\n";
+
+// for requests that were taken over but found no program to run them
+static char cgi_error[] = "HTTP/1.1 500 Internal Server Error\r\n"
+                          "Server: blg312e Web Server\r\n"
+                          "Connection: close\r\n"
+                          "Content-Length: 0\r\n\r\n";
+
+struct cgi_pool;
+
+//
+// A classic child or a pool process, as watched by the reaper
+//
+typedef struct cgi_proc {
+   pid_t pid;
+   int pidfd;      // classic children: readable once the child exited
+   int out;        // classic children: their standard output, -1 once it ended
+   int blocked;    // classic children: the client socket is full
+   int sock;       // pool processes: our end of the socket pair, -1 if gone
+   int outfd;      // client socket of the running request, -1 when idle
+   int starting;   // pool processes: left to the starter thread
+   struct cgi_pool *pool;   // NULL for classic children
+   struct cgi_proc *next_start;
+} cgi_proc_t;
+
+// a request waiting for a busy pool
+typedef struct cgi_job {
+   char *cgiargs;
+   int outfd;
+   struct cgi_job *next;
+} cgi_job_t;
+
+typedef struct cgi_pool {
+   char *filename;
+   int broken;              // the program does not speak the pool protocol
+   int started;             // a process of it ever reported ready
+   cgi_proc_t *procs;
+   cgi_job_t *backlog, *backlog_tail;
+   pthread_mutex_t lock;
+   struct cgi_pool *next;
+} cgi_pool_t;
+
+int cgi_pool_size = 0;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static cgi_pool_t *pools;
+static int reaper_epfd;
+
+// pool processes to start, which the starter thread does without holding
+// a lock, so nobody waits for a slow program to get ready
+static pthread_mutex_t starter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t starter_cond = PTHREAD_COND_INITIALIZER;
+static cgi_proc_t *to_start;
+
+//
+// Returns a copy of environ with extra (a "NAME=value" string) added,
+// replacing any variable of the same name
+//
+static char **cgiEnv(char *extra)
+{
+   int n = 0, i, j = 0;
+   int namelen = strchr(extra, '=') - extra + 1;
+   char **envp;
+
+   while (environ[n] != NULL)
+      n++;
+   envp = (char**)malloc(sizeof(char*) * (n + 2));
+   for (i = 0; i < n; i++) {
+      if (strncmp(environ[i], extra, namelen) != 0)
+         envp[j++] = environ[i];
+   }
+   envp[j++] = extra;
+   envp[j] = NULL;
+   return envp;
+}
+
+//
+// Spawns filename with the given file actions and extra environment variable.
+// The child gets default SIGPIPE handling back, which the server ignores.
+//
+static pid_t cgiStart(char *filename, posix_spawn_file_actions_t *actions, char *extra)
+{
+   posix_spawnattr_t attr;
+   sigset_t sigdefault;
+   char *argv[] = {filename, NULL};
+   char **envp = cgiEnv(extra);
+   pid_t pid;
+   int rc;
+   long long start = metricsNow();
+
+   posix_spawnattr_init(&attr);
+   sigemptyset(&sigdefault);
+   sigaddset(&sigdefault, SIGPIPE);
+   posix_spawnattr_setsigdefault(&attr, &sigdefault);
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+   rc = posix_spawn(&pid, filename, actions, &attr, argv, envp);
+   metricsObserve(METRIC_CGI_SPAWN, metricsNow() - start);
+
+   posix_spawnattr_destroy(&attr);
+   free(envp);
+   if (rc != 0) {
+      fprintf(stderr, "posix_spawn %s: %s\n", filename, strerror(rc));
+      return -1;
+   }
+   return pid;
+}
+
+//
+// Starts filename as a classic CGI program with its standard output on
+// outfd. Returns the child's pid, or -1 if it could not be started.
+//
+pid_t cgiSpawn(char *filename, char *cgiargs, int outfd)
+{
+   posix_spawn_file_actions_t actions;
+   char *query;
+   pid_t pid;
+
+   query = (char*)malloc(strlen("QUERY_STRING=") + strlen(cgiargs) + 1);
+   sprintf(query, "QUERY_STRING=%s", cgiargs);
+
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+   pid = cgiStart(filename, &actions, query);
+   posix_spawn_file_actions_destroy(&actions);
+
+   free(query);
+   return pid;
+}
+
+static void cgiWatch(cgi_proc_t *proc, int fd, int events)
+{
+   struct epoll_event ev;
+
+   ev.events = events;
+   ev.data.ptr = proc;
+   Epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+//
+// Must come before closing a watched descriptor: a child spawned by
+// another thread may still share it, which would keep it in the epoll set
+//
+static void cgiUnwatch(int fd)
+{
+   epoll_ctl(reaper_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+//
+// Sends the server's part of the header, once the program is running
+//
+static void cgiHeader(int outfd)
+{
+   if (rio_writen(outfd, cgi_header, sizeof(cgi_header) - 1) > 0)
+      metricsAdd(METRIC_BYTES_SENT, sizeof(cgi_header) - 1);
+}
+
+//
+// Answers a request that was taken over 500 and closes its socket
+//
+static void cgiFail(int outfd)
+{
+   rio_writen(outfd, cgi_error, sizeof(cgi_error) - 1);
+   Close(outfd);
+}
+
+//
+// Ends the request a process was running by closing our copy of its
+// client socket; the connection closes once the process let go of it too
+//
+static void cgiProcFinish(cgi_proc_t *proc)
+{
+   if (proc->outfd >= 0) {
+      Close(proc->outfd);
+      proc->outfd = -1;
+   }
+}
+
+static void cgiProcStop(cgi_proc_t *proc)
+{
+   cgiProcFinish(proc);
+   if (proc->sock >= 0) {
+      cgiUnwatch(proc->sock);
+      close(proc->sock);
+      proc->sock = -1;
+   }
+   if (proc->pid > 0) {
+      kill(proc->pid, SIGKILL);
+      waitpid(proc->pid, NULL, 0);
+      proc->pid = -1;
+   }
+}
+
+//
+// Starts one pool process and waits for it to report ready. The caller
+// has the reaper watch it. Returns 0 on success, -1 if the program does
+// not speak the protocol.
+//
+static int cgiProcStart(char *filename, cgi_proc_t *proc)
+{
+   posix_spawn_file_actions_t actions;
+   struct timeval timeout = {CGI_READY_TIMEOUT, 0};
+   int sv[2];
+   char ready;
+
+   proc->pid = -1;
+   proc->pidfd = -1;
+   proc->sock = -1;
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+      return -1;
+
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_adddup2(&actions, sv[1], CGI_POOL_FD);
+   // output only ever goes to client sockets passed in later
+   posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+   proc->pid = cgiStart(filename, &actions, CGI_POOL_ENV "=1");
+   posix_spawn_file_actions_destroy(&actions);
+   Close(sv[1]);
+   proc->sock = sv[0];
+
+   Setsockopt(proc->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   if (proc->pid < 0 || recv(proc->sock, &ready, 1, 0) != 1) {
+      cgiProcStop(proc);
+      return -1;
+   }
+   return 0;
+}
+
+//
+// Finds the pool for filename. A new pool has no processes yet, they are
+// started once requests arrive for it.
+//
+static cgi_pool_t *cgiPoolGet(char *filename)
+{
+   cgi_pool_t *pool;
+   cgi_proc_t *proc;
+   int i;
+
+   pthread_mutex_lock(&pools_lock);
+   for (pool = pools; pool != NULL; pool = pool->next) {
+      if (strcmp(pool->filename, filename) == 0)
+         break;
+   }
+   if (pool == NULL) {
+      pool = (cgi_pool_t*)malloc(sizeof(cgi_pool_t));
+      pool->filename = strdup(filename);
+      pool->procs = (cgi_proc_t*)malloc(sizeof(cgi_proc_t) * cgi_pool_size);
+      pthread_mutex_init(&pool->lock, NULL);
+      pool->backlog = pool->backlog_tail = NULL;
+      pool->broken = 0;
+      pool->started = 0;
+      for (i = 0; i < cgi_pool_size; i++) {
+         proc = &pool->procs[i];
+         proc->pid = -1;
+         proc->pidfd = -1;
+         proc->out = -1;
+         proc->sock = -1;
+         proc->outfd = -1;
+         proc->starting = 0;
+         proc->pool = pool;
+      }
+      pool->next = pools;
+      pools = pool;
+   }
+   pthread_mutex_unlock(&pools_lock);
+   return pool;
+}
+//
+// Sends the query string, the server's part of the header and the client
+// socket to a pool process
+//
+static int cgiProcSend(cgi_proc_t *proc, char *cgiargs, int outfd)
+{
+   struct msghdr msg;
+   struct iovec iov[2];
+   struct cmsghdr *cmsg;
+   char control[CMSG_SPACE(sizeof(int))];
+   ssize_t n;
+
+   memset(&msg, 0, sizeof(msg));
+   memset(control, 0, sizeof(control));
+   iov[0].iov_base = cgiargs;
+   iov[0].iov_len = strlen(cgiargs) + 1;   // never empty, includes the NUL
+   iov[1].iov_base = cgi_header;
+   iov[1].iov_len = sizeof(cgi_header) - 1;
+   msg.msg_iov = iov;
+   msg.msg_iovlen = 2;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &outfd, sizeof(int));
+
+   while ((n = sendmsg(proc->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+   return n < 0 ? -1 : 0;
+}
+
+//
+// Has the starter thread start a pool process that is not running. The
+// pool must be locked.
+//
+static void cgiProcRestart(cgi_proc_t *proc)
+{
+   if (proc->starting)
+      return;
+   proc->starting = 1;
+   pthread_mutex_lock(&starter_lock);
+   proc->next_start = to_start;
+   to_start = proc;
+   pthread_cond_signal(&starter_cond);
+   pthread_mutex_unlock(&starter_lock);
+}
+
+//
+// Starts a request on an idle pool process that is running. Returns -1
+// if the process is gone; then it was stopped and outfd is still ours,
+// with nothing written to it. The pool must be locked.
+//
+static int cgiProcRun(cgi_proc_t *proc, char *cgiargs, int outfd)
+{
+   if (cgiProcSend(proc, cgiargs, outfd) < 0) {
+      cgiProcStop(proc);
+      return -1;
+   }
+   proc->outfd = outfd;
+   metricsAdd(METRIC_BYTES_SENT, sizeof(cgi_header) - 1);
+   return 0;
+}
+
+//
+// Gives a pool process that became idle the oldest waiting request, or
+// has it started again if it is gone and requests are waiting. The pool
+// must be locked.
+//
+static void cgiProcNext(cgi_proc_t *proc)
+{
+   cgi_pool_t *pool = proc->pool;
+   cgi_job_t *job;
+
+   if (proc->sock >= 0 && proc->outfd < 0 && (job = pool->backlog) != NULL) {
+      pool->backlog = job->next;
+      if (cgiProcRun(proc, job->cgiargs, job->outfd) == 0) {
+         free(job->cgiargs);
+         free(job);
+      } else {
+         // the process went away; the request waits for the next one
+         pool->backlog = job;
+      }
+      if (pool->backlog == NULL)
+         pool->backlog_tail = NULL;
+   }
+   if (proc->sock < 0 && pool->backlog != NULL)
+      cgiProcRestart(proc);
+}
+//
+// Runs a request on a process of filename's pool without waiting for it:
+// it is queued, and taken by the first idle process, or waits while the
+// processes that are not running are started. Returns -1 if the program
+// cannot be pooled, in which case nothing was written and outfd is still
+// ours.
+//
+static int cgiPoolRun(char *filename, char *cgiargs, int outfd)
+{
+   cgi_pool_t *pool = cgiPoolGet(filename);
+   cgi_job_t *job;
+   int i;
+
+   pthread_mutex_lock(&pool->lock);
+   if (pool->broken) {
+      pthread_mutex_unlock(&pool->lock);
+      return -1;
+   }
+   job = (cgi_job_t*)malloc(sizeof(cgi_job_t));
+   job->cgiargs = strdup(cgiargs);
+   job->outfd = outfd;
+   job->next = NULL;
+   if (pool->backlog_tail)
+      pool->backlog_tail->next = job;
+   else
+      pool->backlog = job;
+   pool->backlog_tail = job;
+   for (i = 0; i < cgi_pool_size && pool->backlog != NULL; i++)
+      cgiProcNext(&pool->procs[i]);
+   pthread_mutex_unlock(&pool->lock);
+   return 0;
+}
+
+//
+// Starts filename as a classic CGI program writing into a pipe, and lets
+// the reaper move its output to outfd. Without pidfd support the output
+// is moved and the child waited for here. Returns -1 if the program could
+// not be started, in which case nothing was written to outfd.
+//
+static int cgiSpawnRun(char *filename, char *cgiargs, int outfd)
+{
+   cgi_proc_t *proc;
+   pid_t pid;
+   int pidfd, out[2];
+
+   if (pipe2(out, O_CLOEXEC) < 0)
+      return -1;
+   pid = cgiSpawn(filename, cgiargs, out[1]);
+   Close(out[1]);
+   if (pid < 0) {
+      Close(out[0]);
+      return -1;
+   }
+   // the child's output waits in the pipe until the header is out
+   cgiHeader(outfd);
+   if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+      while (splice(out[0], NULL, outfd, NULL, CGI_RELAY_CHUNK, SPLICE_F_MOVE) > 0)
+         ;
+      waitpid(pid, NULL, 0);
+      Close(out[0]);
+      Close(outfd);
+      return 0;
+   }
+
+   proc = (cgi_proc_t*)malloc(sizeof(cgi_proc_t));
+   proc->pid = pid;
+   proc->pidfd = pidfd;
+   proc->out = out[0];
+   proc->blocked = 0;
+   proc->sock = -1;
+   proc->outfd = outfd;
+   proc->pool = NULL;
+   // the reaper must not block on a slow client
+   Fcntl(outfd, F_SETFL, Fcntl(outfd, F_GETFL, 0) | O_NONBLOCK);
+   cgiWatch(proc, out[0], EPOLLIN);
+   return 0;
+}
+
+//
+// Runs filename for a request whose client socket is outfd, without
+// waiting for the program, and sends the start of the header. Returns 0
+// if outfd was taken over and will be closed when the program is done,
+// -1 if the program could not be started; then nothing was written and
+// the caller still owns outfd.
+//
+int cgiRun(char *filename, char *cgiargs, int outfd)
+{
+   if (cgi_pool_size > 0 && cgiPoolRun(filename, cgiargs, outfd) == 0)
+      return 0;
+   return cgiSpawnRun(filename, cgiargs, outfd);
+}
+
+//
+// A pool process sent its done byte, or went away
+//
+static void cgiReapPoolProc(cgi_proc_t *proc)
+{
+   char done;
+   ssize_t n;
+
+   pthread_mutex_lock(&proc->pool->lock);
+   if (proc->sock >= 0) {
+      n = recv(proc->sock, &done, 1, MSG_DONTWAIT);
+      if (n == 1)
+         cgiProcFinish(proc);
+      else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+         cgiProcStop(proc);
+   }
+   cgiProcNext(proc);
+   pthread_mutex_unlock(&proc->pool->lock);
+}
+
+//
+// Moves the output of a classic child to its client until the pipe is
+// empty or the socket full, and then waits for whichever holds it up.
+// Once the output ended, or the client went away, the request is done
+// and the reaper waits for the child to exit.
+//
+static void cgiRelay(cgi_proc_t *proc)
+{
+   ssize_t n;
+   int avail = 0, blocked;
+
+   while ((n = splice(proc->out, NULL, proc->outfd, NULL, CGI_RELAY_CHUNK,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0 || (n < 0 && errno == EINTR)) {
+      if (n > 0)
+         metricsAdd(METRIC_BYTES_SENT, n);
+   }
+   if (n < 0 && errno == EAGAIN) {
+      // if the pipe still holds something, the socket is what is full
+      blocked = ioctl(proc->out, FIONREAD, &avail) == 0 && avail > 0;
+      if (blocked != proc->blocked) {
+         cgiUnwatch(proc->blocked ? proc->outfd : proc->out);
+         if (blocked)
+            cgiWatch(proc, proc->outfd, EPOLLOUT);
+         else
+            cgiWatch(proc, proc->out, EPOLLIN);
+         proc->blocked = blocked;
+      }
+      return;
+   }
+
+   cgiUnwatch(proc->blocked ? proc->outfd : proc->out);
+   Close(proc->out);
+   proc->out = -1;
+   cgiProcFinish(proc);
+   cgiWatch(proc, proc->pidfd, EPOLLIN);
+}
+
+static void *cgiReaper(void *arg)
+{
+   struct epoll_event events[CGI_MAXEVENTS];
+   cgi_proc_t *proc;
+   int i, n;
+
+   while (1) {
+      n = Epoll_wait(reaper_epfd, events, CGI_MAXEVENTS, -1);
+      for (i = 0; i < n; i++) {
+         proc = (cgi_proc_t*)events[i].data.ptr;
+         if (proc->pool != NULL) {
+            cgiReapPoolProc(proc);
+            continue;
+         }
+         if (proc->out >= 0) {
+            cgiRelay(proc);
+            continue;
+         }
+         // this particular child exited
+         waitpid(proc->pid, NULL, 0);
+         cgiUnwatch(proc->pidfd);
+         Close(proc->pidfd);
+         cgiProcFinish(proc);
+         free(proc);
+      }
+   }
+   return NULL;
+}
+
+//
+// Runs requests that waited for a pool with no process left as classic CGI
+//
+static void cgiRunJobs(char *filename, cgi_job_t *job)
+{
+   cgi_job_t *next;
+
+   for (; job != NULL; job = next) {
+      next = job->next;
+      if (cgiSpawnRun(filename, job->cgiargs, job->outfd) < 0)
+         cgiFail(job->outfd);
+      free(job->cgiargs);
+      free(job);
+   }
+}
+
+//
+// Returns 1 if a process of the pool runs or is being started. The pool
+// must be locked.
+//
+static int cgiPoolAlive(cgi_pool_t *pool)
+{
+   int i;
+
+   for (i = 0; i < cgi_pool_size; i++) {
+      if (pool->procs[i].sock >= 0 || pool->procs[i].starting)
+         return 1;
+   }
+   return 0;
+}
+
+//
+// Starts the pool processes asked for by cgiProcRestart, one at a time and
+// without holding a lock while a program gets ready. A process that
+// started takes the next waiting request. If a pool turns out to have no
+// process left, its waiting requests run as classic CGI instead.
+//
+static void *cgiStarter(void *arg)
+{
+   cgi_proc_t *proc, started;
+   cgi_pool_t *pool;
+   cgi_job_t *jobs;
+   int rc;
+
+   while (1) {
+      pthread_mutex_lock(&starter_lock);
+      while (to_start == NULL)
+         pthread_cond_wait(&starter_cond, &starter_lock);
+      proc = to_start;
+      to_start = proc->next_start;
+      pthread_mutex_unlock(&starter_lock);
+      pool = proc->pool;
+
+      pthread_mutex_lock(&pool->lock);
+      rc = pool->broken ? -1 : 0;
+      pthread_mutex_unlock(&pool->lock);
+      started.outfd = -1;
+      started.pool = pool;
+      if (rc == 0)
+         rc = cgiProcStart(pool->filename, &started);
+
+      jobs = NULL;
+      pthread_mutex_lock(&pool->lock);
+      proc->starting = 0;
+      if (rc == 0) {
+         proc->pid = started.pid;
+         proc->sock = started.sock;
+         pool->started = 1;
+         // from now on the reaper only reads it when it is readable
+         cgiWatch(proc, proc->sock, EPOLLIN);
+         cgiProcNext(proc);
+      } else {
+         if (!pool->started)
+            pool->broken = 1;
+         if (!cgiPoolAlive(pool)) {
+            jobs = pool->backlog;
+            pool->backlog = pool->backlog_tail = NULL;
+         }
+      }
+      pthread_mutex_unlock(&pool->lock);
+      cgiRunJobs(pool->filename, jobs);
+   }
+   return NULL;
+}
+
+void cgiInit(void)
+{
+   pthread_t tid;
+
+   reaper_epfd = Epoll_create1(EPOLL_CLOEXEC);
+   pthread_create(&tid, NULL, cgiReaper, NULL);
+   pthread_detach(tid);
+   if (cgi_pool_size > 0) {
+      pthread_create(&tid, NULL, cgiStarter, NULL);
+      pthread_detach(tid);
+   }
+}
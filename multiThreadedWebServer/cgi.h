@@ -0,0 +1,32 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+/*
+ * Running CGI programs.
+ *
+ * Classic CGI programs are started per request with posix_spawn, which
+ * does not copy the server's address space the way fork does. Nobody
+ * waits for them on a worker thread: a reaper thread moves their output
+ * from a pipe to the client socket and closes it when the output ends.
+ *
+ * With cgi_pool_size > 0, each CGI program is instead kept running as a
+ * pool of that many processes. A pool process is started with
+ * CGI_POOL_ENV set in its environment and a SOCK_SEQPACKET Unix socket on
+ * descriptor CGI_POOL_FD. It sends one byte when ready, then for every
+ * request receives a message holding the query string, its NUL and the
+ * server's part of the header, with the client socket attached
+ * (SCM_RIGHTS). It writes that part of the header and then its output to
+ * that socket, and sends one byte back when done. Programs that never send the ready byte
+ * are run as classic CGI instead.
+ */
+#define CGI_POOL_ENV "BLG312E_CGI_POOL"
+#define CGI_POOL_FD 3
+
+/* Processes kept per CGI program, 0 starts a process per request */
+extern int cgi_pool_size;
+
+void cgiInit(void);
+pid_t cgiSpawn(char *filename, char *cgiargs, int outfd);
+int cgiRun(char *filename, char *cgiargs, int outfd);
+
+#endif
@@ -24,7 +24,9 @@ void clientSend(int fd, char *filename)
 
   /* Form and send the HTTP request */
   sprintf(buf, "GET %s HTTP/1.1\r\n", filename);
-  sprintf(buf, "%shost: %s\r\n\r\n", buf, hostname);
+  snprintf(buf + strlen(buf), MAXLINE - strlen(buf), "host: %s\r\n", hostname);
+  /* The body is read until the server closes the connection */
+  snprintf(buf + strlen(buf), MAXLINE - strlen(buf), "Connection: close\r\n\r\n");
   Rio_writen(fd, buf, strlen(buf));
 }
   
@@ -0,0 +1,632 @@
+//
+// event.c: Event-driven front end of the web server.
+//
+// An event loop accepts connections and reads request heads from all of
+// them with edge-triggered epoll on non-blocking sockets. Only connections
+// whose request line and headers have fully arrived are handed to the
+// worker pool, so a client that trickles its request never holds a worker
+// or the request queue. Persistent connections come back here between
+// requests, so an idle keep-alive connection does not pin a worker either.
+// Likewise a connection whose large response filled the socket waits here
+// until the client has read enough, then goes back to the workers.
+//
+// Each loop runs on its own thread with its own listening socket; with
+// SO_REUSEPORT several loops share a port and the kernel spreads new
+// connections over them. A connection stays with the loop that accepted it.
+//
+// Built with USE_IO_URING, a loop runs on io_uring instead if the kernel
+// allows it: rather than being told a socket is ready and then reading it,
+// the loop keeps a receive into the request buffer in flight for every
+// connection, and submits new operations and collects completions with a
+// single system call per batch. Sockets stay blocking in that mode.
+//
+
+#define _GNU_SOURCE
+#include "blg312e.h"
+#include "request.h"
+#include "event.h"
+#include "metrics.h"
+#include "log.h"
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <stdint.h>
+
+#ifdef USE_IO_URING
+#include "uring.h"
+
+#define URING_ENTRIES 4096
+
+// user_data of the loop's own operations; a request's is its address
+enum { URING_ACCEPT = 1, URING_WAKE, URING_TIMER };
+
+// indices of the loop's fixed files
+enum { URING_LISTENFD, URING_WAKEFD };
+#endif
+
+#define MAXEVENTS 256
+
+int keepalive_timeout = 5;
+int send_timeout = 60;
+int max_connections = 0;
+
+// connections waiting in a loop, least recently active first
+typedef struct {
+   request_t *head, *tail;
+} event_list_t;
+
+typedef struct event_loop {
+   int listenfd;
+   int epfd;
+   int wakefd;   // eventfd that tells the loop connections were resumed
+   void (*dispatch)(request_t *request);
+
+   // connections handed back by workers, protected by resumed_lock
+   pthread_mutex_t resumed_lock;
+   request_t *resumed;
+
+   // connections waiting for a request, and connections waiting for room
+   // in the socket to send more of a body
+   event_list_t idle, sending;
+
+#ifdef USE_IO_URING
+   uring_t *ring;          // NULL if the loop runs on epoll
+   uint64_t wakes;         // the eventfd is read into this
+   struct __kernel_timespec tick;
+   int accepting;          // a multishot accept is in flight
+#endif
+} event_loop_t;
+
+static void eventSetBlocking(int fd, int blocking)
+{
+   int flags = Fcntl(fd, F_GETFL, 0);
+
+   if (blocking)
+      flags &= ~O_NONBLOCK;
+   else
+      flags |= O_NONBLOCK;
+   Fcntl(fd, F_SETFL, flags);
+}
+
+//
+// Returns the list a connection waits in, which only changes while a
+// worker has it
+//
+static event_list_t *eventList(request_t *request)
+{
+   return request->body_fd >= 0 ? &request->loop->sending : &request->loop->idle;
+}
+
+static void eventUnlink(request_t *request)
+{
+   event_list_t *list = eventList(request);
+
+   if (request->prev == NULL && list->head != request)
+      return;   // not in the list
+   if (request->prev)
+      request->prev->next = request->next;
+   else
+      list->head = request->next;
+   if (request->next)
+      request->next->prev = request->prev;
+   else
+      list->tail = request->prev;
+   request->prev = request->next = NULL;
+}
+
+//
+// Moves request to the most recently active end of its list
+//
+static void eventTouch(request_t *request, time_t now)
+{
+   event_list_t *list = eventList(request);
+
+   eventUnlink(request);
+   request->idle_since = now;
+   request->prev = list->tail;
+   if (list->tail)
+      list->tail->next = request;
+   else
+      list->head = request;
+   list->tail = request;
+}
+
+//
+// Returns how much of what was written to the socket the client has not
+// acknowledged yet
+//
+static int eventUnsent(request_t *request)
+{
+   int n;
+
+   if (ioctl(request->connfd, SIOCOUTQ, &n) < 0)
+      return request->unsent;
+   return n;
+}
+
+static int eventUring(event_loop_t *loop)
+{
+#ifdef USE_IO_URING
+   return loop->ring != NULL;
+#else
+   return 0;
+#endif
+}
+
+static void eventClose(request_t *request)
+{
+   eventUnlink(request);
+   // a CGI child being spawned may briefly share the descriptor, so closing
+   // it alone does not always take it out of the epoll set
+   if (!eventUring(request->loop))
+      epoll_ctl(request->loop->epfd, EPOLL_CTL_DEL, request->connfd, NULL);
+   Close(request->connfd);
+   requestFree(request);
+}
+
+#ifdef USE_IO_URING
+//
+// Starts the operation a connection waits on in an io_uring loop: room in
+// the socket while it is in the middle of a response body, otherwise more
+// of its next request
+//
+static void eventArm(request_t *request)
+{
+   uring_t *ring = request->loop->ring;
+   struct io_uring_sqe *sqe;
+
+   if (request->body_fd >= 0) {
+      sqe = uringSqe(ring, IORING_OP_POLL_ADD, request->connfd, NULL, 0, (uintptr_t)request);
+      sqe->poll32_events = POLLOUT;
+   } else {
+      // keep one byte for the terminating NUL
+      uringSqe(ring, IORING_OP_RECV, request->connfd, request->buf + request->len,
+               request->cap - 1 - request->len, (uintptr_t)request);
+   }
+}
+#endif
+
+//
+// Watches a connection for its next request, or for room in the socket
+// while it is in the middle of a response body
+//
+static void eventWatch(request_t *request, int op)
+{
+   struct epoll_event ev;
+
+   // a worker just sent some of the body, which counts as progress
+   if (request->body_fd >= 0)
+      request->unsent = eventUnsent(request);
+#ifdef USE_IO_URING
+   if (eventUring(request->loop)) {
+      eventArm(request);
+      eventTouch(request, time(NULL));
+      return;
+   }
+#endif
+   if (request->body_fd >= 0)
+      ev.events = EPOLLOUT | EPOLLET;
+   else
+      ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+   ev.data.ptr = request;
+   Epoll_ctl(request->loop->epfd, op, request->connfd, &ev);
+   eventTouch(request, time(NULL));
+}
+
+//
+// Turns away a connection accepted over max_connections. Whatever part of
+// the request already arrived is read first, as closing a socket with
+// unread data would reset the connection and lose the 503.
+//
+static void eventReject(request_t *request)
+{
+   char buf[MAXLINE];
+
+   while (recv(request->connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+      ;
+   requestReject(request);
+   metricsAdd(METRIC_REJECTED, 1);
+   Close(request->connfd);
+   requestFree(request);
+}
+
+//
+// Starts waiting for the first request of a newly accepted connection
+//
+static void eventAdopt(event_loop_t *loop, int connfd, struct in_addr client)
+{
+   request_t *request;
+   int one = 1;
+
+   logMessage(LOG_LEVEL_CONNECTIONS, "accepted connection on fd %d", connfd);
+   metricsAdd(METRIC_ACCEPTS, 1);
+   // responses are written in pieces (header, body), which Nagle's
+   // algorithm would hold back until the client's delayed ACK
+   Setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   request = requestNew(connfd);
+   request->client = client;
+   request->loop = loop;
+   if (max_connections > 0 && requestCount() > max_connections) {
+      eventReject(request);
+      return;
+   }
+   eventWatch(request, EPOLL_CTL_ADD);
+}
+
+//
+// Accepts every pending connection; with edge-triggered notification the
+// listening socket is only reported again once new connections arrive
+//
+static void eventAccept(event_loop_t *loop)
+{
+   struct sockaddr_in clientaddr;
+   socklen_t clientlen;
+   int connfd;
+
+   while (1) {
+      clientlen = sizeof(clientaddr);
+      connfd = accept4(loop->listenfd, (SA *)&clientaddr, &clientlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (connfd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+         return;
+      }
+      eventAdopt(loop, connfd, clientaddr.sin_addr);
+   }
+}
+
+//
+// Answers a request whose head does not fit into MAXBUF and closes it
+//
+static void eventTooLarge(request_t *request)
+{
+   eventSetBlocking(request->connfd, 1);
+   request->keep_alive = 0;
+   requestError(request, "", "400", "Bad Request", "blg312e Server could not read this request");
+   eventClose(request);
+}
+
+//
+// Hands a connection whose request head has fully arrived to the workers
+//
+static void eventDispatch(request_t *request)
+{
+   eventUnlink(request);
+   if (!eventUring(request->loop)) {
+      Epoll_ctl(request->loop->epfd, EPOLL_CTL_DEL, request->connfd, NULL);
+      eventSetBlocking(request->connfd, 1);
+   }
+   requestParseHead(request);
+   request->loop->dispatch(request);
+}
+
+//
+// Reads whatever has arrived for request. Once the whole request head is
+// in, the connection leaves the epoll set, goes back to blocking mode for
+// the worker threads and the parsed request is dispatched.
+//
+static void eventRead(request_t *request)
+{
+   int n;
+
+   while (request->headlen == 0) {
+      // keep one byte for the terminating NUL
+      if (request->len == request->cap - 1 && !requestGrow(request)) {
+         eventTooLarge(request);
+         return;
+      }
+      n = read(request->connfd, request->buf + request->len, request->cap - 1 - request->len);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            eventClose(request);
+         return;
+      }
+      if (n == 0) {
+         // client went away, or closed an idle persistent connection
+         eventClose(request);
+         return;
+      }
+      if (request->len == 0)
+         eventTouch(request, time(NULL));   // the head has until the timeout from here
+      request->len += n;
+      request->buf[request->len] = '\0';
+      request->headlen = requestHeadLength(request);
+   }
+   eventDispatch(request);
+}
+
+//
+// The client read some of a response body, so the rest can be sent
+//
+static void eventWritable(request_t *request)
+{
+   eventUnlink(request);
+   Epoll_ctl(request->loop->epfd, EPOLL_CTL_DEL, request->connfd, NULL);
+   request->loop->dispatch(request);
+}
+
+//
+// Hands a connection back to the event loop that accepted it, to wait for
+// its next request or, if a response body is left to send, until the
+// socket is writable. Called by worker threads.
+//
+void eventResume(request_t *request)
+{
+   event_loop_t *loop = request->loop;
+   uint64_t one = 1;
+
+   if (!eventUring(loop))
+      eventSetBlocking(request->connfd, 0);
+
+   pthread_mutex_lock(&loop->resumed_lock);
+   request->next = loop->resumed;
+   loop->resumed = request;
+   pthread_mutex_unlock(&loop->resumed_lock);
+
+   if (write(loop->wakefd, &one, sizeof(one)) < 0)
+      unix_error("eventfd write error");
+}
+
+static void eventTakeResumed(event_loop_t *loop)
+{
+   request_t *request, *next;
+   uint64_t n;
+
+   // an io_uring loop has read the eventfd already
+   if (!eventUring(loop) && read(loop->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      unix_error("eventfd read error");
+
+   pthread_mutex_lock(&loop->resumed_lock);
+   request = loop->resumed;
+   loop->resumed = NULL;
+   pthread_mutex_unlock(&loop->resumed_lock);
+
+   for (; request != NULL; request = next) {
+      next = request->next;
+      request->next = NULL;
+      // edge-triggered registration reports data that is already waiting
+      eventWatch(request, EPOLL_CTL_ADD);
+   }
+}
+
+static void eventDrop(request_t *request)
+{
+   if (eventUring(request->loop)) {
+      // its receive or poll is still in flight; shutting the socket down
+      // ends it, and its completion closes the connection
+      eventUnlink(request);
+      shutdown(request->connfd, SHUT_RDWR);
+   } else {
+      eventClose(request);
+   }
+}
+
+//
+// Closes connections that sent nothing for keepalive_timeout seconds, or
+// did not finish a request head within that long of its first byte, and
+// connections in the middle of a body whose client acknowledged nothing
+// for send_timeout seconds. With large socket buffers the socket may take
+// longer than that to have room again while the client keeps reading, so
+// it is the unacknowledged bytes going down that counts as progress.
+//
+static void eventExpire(event_loop_t *loop, time_t now)
+{
+   request_t *request, *next;
+   int unsent;
+
+   while (keepalive_timeout > 0 && (request = loop->idle.head) != NULL &&
+          now - request->idle_since >= keepalive_timeout)
+      eventDrop(request);
+
+   for (request = loop->sending.head; send_timeout > 0 && request != NULL; request = next) {
+      next = request->next;
+      if ((unsent = eventUnsent(request)) < request->unsent) {
+         request->unsent = unsent;
+         request->idle_since = now;
+      } else if (now - request->idle_since >= send_timeout) {
+         eventDrop(request);
+      }
+   }
+}
+
+#ifdef USE_IO_URING
+//
+// Sets up io_uring for loop. Returns -1 if the kernel does not allow it.
+//
+static int eventUringInit(event_loop_t *loop)
+{
+   uring_t *ring = (uring_t*)malloc(sizeof(uring_t));
+   int files[2];
+
+   if (uringInit(ring, URING_ENTRIES) < 0) {
+      fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+      free(ring);
+      return -1;
+   }
+   // blocking, as io_uring waits for it to become readable itself
+   if ((loop->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+      unix_error("eventfd error");
+   files[URING_LISTENFD] = loop->listenfd;
+   files[URING_WAKEFD] = loop->wakefd;
+   if (uringRegisterFiles(ring, files, 2) < 0)
+      unix_error("io_uring_register error");
+   loop->ring = ring;
+   loop->tick.tv_sec = 1;
+   return 0;
+}
+
+static void eventUringAccept(event_loop_t *loop)
+{
+   struct io_uring_sqe *sqe;
+
+   sqe = uringSqe(loop->ring, IORING_OP_ACCEPT, URING_LISTENFD, NULL, 0, URING_ACCEPT);
+   sqe->flags |= IOSQE_FIXED_FILE;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;   // one completion per connection
+   sqe->accept_flags = SOCK_CLOEXEC;
+   loop->accepting = 1;
+}
+
+//
+// A connection was accepted, or accepting failed with -res. Errors such as
+// running out of descriptors end the multishot accept; it is restarted
+// with the next tick rather than failing again right away.
+//
+static void eventUringAccepted(event_loop_t *loop, int res, int flags)
+{
+   struct sockaddr_in clientaddr;
+   socklen_t clientlen = sizeof(clientaddr);
+
+   if (!(flags & IORING_CQE_F_MORE))
+      loop->accepting = 0;
+   if (res < 0) {
+      if (res != -ECONNABORTED && res != -EINTR)
+         fprintf(stderr, "accept error: %s\n", strerror(-res));
+      return;
+   }
+   if (!loop->accepting)
+      eventUringAccept(loop);
+   if (getpeername(res, (SA *)&clientaddr, &clientlen) < 0)
+      clientaddr.sin_addr.s_addr = 0;
+   eventAdopt(loop, res, clientaddr.sin_addr);
+}
+
+static void eventUringWake(event_loop_t *loop)
+{
+   struct io_uring_sqe *sqe;
+
+   sqe = uringSqe(loop->ring, IORING_OP_READ, URING_WAKEFD, &loop->wakes, sizeof(loop->wakes), URING_WAKE);
+   sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+static void eventUringTimer(event_loop_t *loop)
+{
+   uringSqe(loop->ring, IORING_OP_TIMEOUT, -1, &loop->tick, 1, URING_TIMER);
+}
+
+//
+// The receive or poll of request completed with res
+//
+static void eventUringRequest(request_t *request, int res)
+{
+   if (request->body_fd >= 0) {
+      // room in the socket, or an error the worker will run into
+      eventUnlink(request);
+      request->loop->dispatch(request);
+      return;
+   }
+   if (res == -EINTR || res == -EAGAIN) {
+      eventArm(request);
+      return;
+   }
+   if (res <= 0) {
+      // client went away, closed an idle persistent connection or expired
+      eventClose(request);
+      return;
+   }
+   if (request->len == 0)
+      eventTouch(request, time(NULL));   // the head has until the timeout from here
+   request->len += res;
+   request->buf[request->len] = '\0';
+   request->headlen = requestHeadLength(request);
+   if (request->headlen > 0) {
+      eventDispatch(request);
+      return;
+   }
+   if (request->len == request->cap - 1 && !requestGrow(request)) {
+      eventTooLarge(request);
+      return;
+   }
+   eventArm(request);
+}
+
+static void eventLoopUring(event_loop_t *loop)
+{
+   struct io_uring_cqe *cqe;
+   unsigned long long data;
+   int res, flags;
+
+   eventUringAccept(loop);
+   eventUringWake(loop);
+   eventUringTimer(loop);
+   while (1) {
+      uringEnter(loop->ring, 1);
+      while ((cqe = uringPeek(loop->ring)) != NULL) {
+         data = cqe->user_data;
+         res = cqe->res;
+         flags = cqe->flags;
+         uringSeen(loop->ring);
+
+         if (data == URING_ACCEPT) {
+            eventUringAccepted(loop, res, flags);
+         } else if (data == URING_WAKE) {
+            eventTakeResumed(loop);
+            eventUringWake(loop);
+         } else if (data == URING_TIMER) {
+            eventExpire(loop, time(NULL));
+            if (!loop->accepting)
+               eventUringAccept(loop);
+            eventUringTimer(loop);
+         } else {
+            eventUringRequest((request_t*)(uintptr_t)data, res);
+         }
+      }
+   }
+}
+#endif
+
+//
+// Runs an event loop on listenfd in the calling thread, forever
+//
+void eventLoop(int listenfd, void (*dispatch)(request_t *request))
+{
+   struct epoll_event ev, events[MAXEVENTS];
+   event_loop_t *loop = (event_loop_t*)calloc(1, sizeof(event_loop_t));
+   int i, n;
+
+   loop->listenfd = listenfd;
+   loop->dispatch = dispatch;
+   pthread_mutex_init(&loop->resumed_lock, NULL);
+   // CGI programs must not inherit the listening socket
+   Fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+
+#ifdef USE_IO_URING
+   if (eventUringInit(loop) == 0) {
+      eventLoopUring(loop);
+      return;
+   }
+#endif
+
+   loop->epfd = Epoll_create1(EPOLL_CLOEXEC);
+   if ((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      unix_error("eventfd error");
+   eventSetBlocking(listenfd, 0);
+   ev.events = EPOLLIN | EPOLLET;
+   ev.data.ptr = &loop->listenfd;   // marks the listening socket
+   Epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+   ev.events = EPOLLIN;
+   ev.data.ptr = &loop->wakefd;
+   Epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+
+   while (1) {
+      // wake up once a second to expire idle connections
+      n = Epoll_wait(loop->epfd, events, MAXEVENTS, keepalive_timeout > 0 || send_timeout > 0 ? 1000 : -1);
+      for (i = 0; i < n; i++) {
+         if (events[i].data.ptr == &loop->listenfd)
+            eventAccept(loop);
+         else if (events[i].data.ptr == &loop->wakefd)
+            eventTakeResumed(loop);
+         else if (((request_t*)events[i].data.ptr)->body_fd >= 0)
+            eventWritable((request_t*)events[i].data.ptr);
+         else
+            eventRead((request_t*)events[i].data.ptr);
+      }
+      eventExpire(loop, time(NULL));
+   }
+}
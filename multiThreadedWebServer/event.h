@@ -0,0 +1,21 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "request.h"
+
+/* Seconds a connection may stay idle in the event loop, and a request
+   head may take from its first byte, 0 for no limit */
+extern int keepalive_timeout;
+
+/* Seconds a client may go without reading any of a response body the
+   event loop waits to send more of, 0 for no limit */
+extern int send_timeout;
+
+/* Connections beyond this many are answered 503 and closed right after
+   accept, 0 for no limit */
+extern int max_connections;
+
+void eventLoop(int listenfd, void (*dispatch)(request_t *request));
+void eventResume(request_t *request);
+
+#endif
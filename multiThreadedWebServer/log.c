@@ -0,0 +1,294 @@
+//
+// log.c: Asynchronous access log.
+//
+// Each thread owns a single-producer single-consumer ring of fixed-size
+// records. Logging a request only copies a few fields into the next free
+// record and publishes it with a release store; a full ring drops the
+// record rather than making a worker wait. The writer thread drains all
+// rings, formats the records and writes them with one write(2) per batch,
+// rotating the log file once it reaches log_rotate_size. A thread that
+// exits leaves its ring to the next thread to start.
+//
+
+#include "blg312e.h"
+#include "log.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define LOG_RING 1024          // records per thread
+#define LOG_TEXT 224           // request line or message, truncated
+#define LOG_LINE 512           // longest formatted line
+#define LOG_BATCH (64 * 1024)  // bytes formatted before they are written
+#define LOG_IDLE_US 10000      // writer's nap when all rings were empty
+#define LOG_KEEP 5             // rotated files kept: log.1 ... log.5
+
+enum { LOG_RECORD_REQUEST, LOG_RECORD_MESSAGE };
+
+typedef struct {
+   struct timespec time;
+   int kind;
+   struct in_addr client;
+   int status;
+   long long bytes;
+   long long usecs;
+   char text[LOG_TEXT];
+} log_record_t;
+
+typedef struct log_ring {
+   atomic_ulong head;      // next record the owner fills
+   atomic_ulong dropped;   // records lost because the ring was full
+   atomic_ulong tail __attribute__((aligned(64)));   // next record the writer reads
+   struct log_ring *next;
+   struct log_ring *next_free;
+   log_record_t records[LOG_RING];
+} log_ring_t;
+
+int log_level = LOG_LEVEL_REQUESTS;
+char *log_path = NULL;
+size_t log_rotate_size = 0;
+
+static _Atomic(log_ring_t *) rings;   // only ever grows at the front
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *free_rings;   // rings of threads that exited, under rings_lock
+static __thread log_ring_t *ring;
+static int running;
+
+// owned by the writer thread
+static int log_fd = STDOUT_FILENO;
+static off_t log_size;
+static char batch[LOG_BATCH];
+static int batchlen;
+
+//
+// Returns the calling thread's ring, creating it on first use
+//
+static log_ring_t *logRing(void)
+{
+   if (ring == NULL) {
+      pthread_mutex_lock(&rings_lock);
+      if ((ring = free_rings) != NULL) {
+         // records the last owner left are still drained in order
+         free_rings = ring->next_free;
+      } else {
+         ring = (log_ring_t*)aligned_alloc(64, sizeof(log_ring_t));
+         atomic_init(&ring->head, 0);
+         atomic_init(&ring->dropped, 0);
+         atomic_init(&ring->tail, 0);
+         ring->next = atomic_load(&rings);
+         atomic_store(&rings, ring);
+      }
+      pthread_mutex_unlock(&rings_lock);
+   }
+   return ring;
+}
+
+//
+// Leaves the calling thread's ring to the next thread that starts. Called
+// by threads about to exit.
+//
+void logRelease(void)
+{
+   if (ring == NULL)
+      return;
+   pthread_mutex_lock(&rings_lock);
+   ring->next_free = free_rings;
+   free_rings = ring;
+   pthread_mutex_unlock(&rings_lock);
+   ring = NULL;
+}
+
+//
+// Returns the next free record of the calling thread's ring, NULL if the
+// ring is full. logCommit publishes it.
+//
+static log_record_t *logReserve(void)
+{
+   log_ring_t *r = logRing();
+   unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+   if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING) {
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return NULL;
+   }
+   return &r->records[head % LOG_RING];
+}
+
+static void logCommit(void)
+{
+   unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+   atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void logRequest(request_t *request, long long ns)
+{
+   log_record_t *rec;
+
+   if (!running || log_level < LOG_LEVEL_ERRORS ||
+       (log_level == LOG_LEVEL_ERRORS && request->status < 400))
+      return;
+   if ((rec = logReserve()) == NULL)
+      return;
+   clock_gettime(CLOCK_REALTIME, &rec->time);
+   rec->kind = LOG_RECORD_REQUEST;
+   rec->client = request->client;
+   rec->status = request->status;
+   rec->bytes = request->sent;
+   rec->usecs = ns / 1000;
+   snprintf(rec->text, LOG_TEXT, "%s %s %s", request->method.ptr, request->uri.ptr, request->version.ptr);
+   logCommit();
+}
+
+void logMessage(int level, const char *fmt, ...)
+{
+   log_record_t *rec;
+   va_list ap;
+
+   if (!running || level > log_level)
+      return;
+   if ((rec = logReserve()) == NULL)
+      return;
+   clock_gettime(CLOCK_REALTIME, &rec->time);
+   rec->kind = LOG_RECORD_MESSAGE;
+   va_start(ap, fmt);
+   vsnprintf(rec->text, LOG_TEXT, fmt, ap);
+   va_end(ap);
+   logCommit();
+}
+
+static void logOpen(void)
+{
+   struct stat sbuf;
+
+   log_fd = Open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, DEF_MODE);
+   Fstat(log_fd, &sbuf);
+   log_size = sbuf.st_size;
+}
+
+//
+// Renames log to log.1, log.1 to log.2 and so on, and starts a new log
+//
+static void logRotate(void)
+{
+   char from[MAXLINE], to[MAXLINE];
+
+   Close(log_fd);
+   for (int i = LOG_KEEP - 1; i >= 1; i--) {
+      snprintf(from, sizeof(from), "%s.%d", log_path, i);
+      snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+      rename(from, to);
+   }
+   snprintf(to, sizeof(to), "%s.1", log_path);
+   rename(log_path, to);
+   logOpen();
+}
+
+static void logFlush(void)
+{
+   char *p = batch;
+   ssize_t n;
+
+   while (batchlen > 0) {
+      if ((n = write(log_fd, p, batchlen)) < 0) {
+         if (errno == EINTR)
+            continue;
+         break;   // nowhere to complain to, the batch is lost
+      }
+      p += n;
+      batchlen -= n;
+      log_size += n;
+   }
+   batchlen = 0;
+   if (log_path != NULL && log_rotate_size > 0 && log_size >= log_rotate_size)
+      logRotate();
+}
+
+//
+// Appends text as a quoted value, escaping what would break the line
+//
+static void logQuote(const char *text)
+{
+   batch[batchlen++] = '"';
+   for (; *text; text++) {
+      unsigned char c = *text;
+      if (c == '"' || c == '\\') {
+         batch[batchlen++] = '\\';
+         batch[batchlen++] = c;
+      } else if (c < ' ' || c >= 127) {
+         batchlen += sprintf(batch + batchlen, "\\x%02x", c);
+      } else {
+         batch[batchlen++] = c;
+      }
+   }
+   batch[batchlen++] = '"';
+}
+
+static void logFormat(log_record_t *rec)
+{
+   char when[32], addr[INET_ADDRSTRLEN];
+   struct tm tm;
+
+   if (batchlen + LOG_LINE + 4 * LOG_TEXT > LOG_BATCH)
+      logFlush();
+
+   gmtime_r(&rec->time.tv_sec, &tm);
+   strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+   batchlen += sprintf(batch + batchlen, "time=%s.%03ldZ ", when, rec->time.tv_nsec / 1000000);
+
+   if (rec->kind == LOG_RECORD_MESSAGE) {
+      batchlen += sprintf(batch + batchlen, "msg=");
+      logQuote(rec->text);
+   } else {
+      inet_ntop(AF_INET, &rec->client, addr, sizeof(addr));
+      batchlen += sprintf(batch + batchlen, "client=%s request=", addr);
+      logQuote(rec->text);
+      batchlen += sprintf(batch + batchlen, " status=%d bytes=%lld duration_us=%lld",
+                          rec->status, rec->bytes, rec->usecs);
+   }
+   batch[batchlen++] = '\n';
+}
+
+static void *logWriter(void *arg)
+{
+   log_ring_t *r;
+   log_record_t dropped;
+   unsigned long head, tail, lost;
+   int n;
+
+   dropped.kind = LOG_RECORD_MESSAGE;
+   while (1) {
+      n = 0;
+      for (r = atomic_load(&rings); r != NULL; r = r->next) {
+         tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+         head = atomic_load_explicit(&r->head, memory_order_acquire);
+         for (; tail != head; tail++, n++)
+            logFormat(&r->records[tail % LOG_RING]);
+         atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+         if ((lost = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed)) > 0) {
+            clock_gettime(CLOCK_REALTIME, &dropped.time);
+            sprintf(dropped.text, "log ring full, dropped %lu records", lost);
+            logFormat(&dropped);
+         }
+      }
+      if (batchlen > 0)
+         logFlush();
+      if (n == 0)
+         usleep(LOG_IDLE_US);
+   }
+   return NULL;
+}
+
+void logInit(void)
+{
+   pthread_t tid;
+
+   if (log_level == LOG_LEVEL_OFF)
+      return;
+   if (log_path != NULL)
+      logOpen();
+   running = 1;
+   pthread_create(&tid, NULL, logWriter, NULL);
+   pthread_detach(tid);
+}
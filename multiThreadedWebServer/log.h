@@ -0,0 +1,29 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "request.h"
+
+/*
+ * Access log. Threads append records to their own ring buffer without
+ * locking or formatting; a background thread turns them into lines of
+ * key=value pairs and writes them out in batches.
+ */
+
+/* What gets logged; every level includes the ones before it */
+enum {
+    LOG_LEVEL_OFF,
+    LOG_LEVEL_ERRORS,       /* requests answered with 4xx or 5xx */
+    LOG_LEVEL_REQUESTS,     /* every request */
+    LOG_LEVEL_CONNECTIONS   /* accepted connections too */
+};
+
+extern int log_level;
+extern char *log_path;          /* NULL logs to standard output */
+extern size_t log_rotate_size;  /* rotate the file at this size, 0 never */
+
+void logInit(void);
+void logRequest(request_t *request, long long ns);
+void logMessage(int level, const char *fmt, ...);
+void logRelease(void);
+
+#endif
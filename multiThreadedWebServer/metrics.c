@@ -0,0 +1,289 @@
+//
+// metrics.c: Counters and latency histograms for the /metrics endpoint.
+//
+// Each thread gets its own slot the first time it records something, so
+// the hot path only ever writes to cache lines no other thread writes.
+// A thread that exits gives its slot, counts and all, to the next one.
+// Rendering sums all slots; the relaxed atomics only make sure it reads
+// whole values, not a consistent snapshot across counters.
+//
+
+#include "blg312e.h"
+#include "metrics.h"
+#include <stdatomic.h>
+#include <time.h>
+
+#define METRICS_SLOTS 256      // threads with a slot of their own
+#define METRICS_GAUGES 16
+#define METRICS_NBUCKETS 17    // finite histogram bounds
+
+typedef struct {
+   long long buckets[METRICS_NBUCKETS + 1];   // the last one is +Inf
+   long long count;
+   long long sum_ns;
+} metrics_hist_t;
+
+typedef struct {
+   long long counters[METRIC_NCOUNTERS];
+   metrics_hist_t hists[METRIC_NHISTS];
+} __attribute__((aligned(64))) metrics_slot_t;
+
+typedef struct {
+   const char *name;
+   const char *help;
+   long (*read)(void);
+} metrics_gauge_t;
+
+// upper bounds of the histogram buckets, in ns
+static const long long bounds[METRICS_NBUCKETS] = {
+   50000, 100000, 250000, 500000,
+   1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+   100000000, 250000000, 500000000,
+   1000000000, 2500000000LL, 5000000000LL, 10000000000LL
+};
+
+static const char *counter_names[METRIC_NCOUNTERS][2] = {
+   {"blg312e_accepted_connections_total", "Connections accepted."},
+   {"blg312e_requests_total", "Requests handled."},
+   {"blg312e_sent_bytes_total", "Bytes written to clients by the server, not counting CGI output."},
+   {"blg312e_cache_hits_total", "Static responses served from the cache."},
+   {"blg312e_cache_misses_total", "Cacheable static responses that had to be loaded."},
+   {"blg312e_stat_cache_hits_total", "File lookups answered from the metadata cache."},
+   {"blg312e_stat_cache_misses_total", "File lookups that had to stat() the file."},
+   {"blg312e_prefetched_bytes_total", "Bytes of queued files read ahead into the page cache."},
+   {"blg312e_worker_busy_seconds_total", "Time worker threads spent handling requests."},
+   {"blg312e_pool_grown_total", "Worker threads started because requests waited too long."},
+   {"blg312e_pool_shrunk_total", "Surplus worker threads that exited after idling."},
+   {"blg312e_rejected_connections_total", "Connections answered 503 at accept because too many were open."},
+   {"blg312e_shed_requests_total", "Requests answered 503 because the queue was full or too slow."},
+};
+
+static const char *hist_names[METRIC_NHISTS][2] = {
+   {"blg312e_queue_wait_seconds", "Time requests waited in the queue for a worker."},
+   {"blg312e_service_seconds", "Time a worker spent handling a request."},
+   {"blg312e_cgi_spawn_seconds", "Time to start a CGI process."},
+};
+
+static metrics_slot_t slots[METRICS_SLOTS];
+static atomic_int nslots;
+static __thread metrics_slot_t *self;
+
+// slots given back by threads that exited, under slots_lock
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_slots[METRICS_SLOTS];
+static int nfree;
+
+static metrics_gauge_t gauges[METRICS_GAUGES];
+static int ngauges;
+
+static const char *metrics_policy = "";
+static long long started;
+
+// the size of the worker pool over time
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int workers;
+static long long workers_since;     // when workers last changed
+static long long workers_ns;        // sum of workers * time before that
+
+void metricsInit(const char *policy)
+{
+   metrics_policy = policy;
+   started = workers_since = metricsNow();
+}
+
+// monotonic time in ns
+long long metricsNow(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static metrics_slot_t *metricsSelf(void)
+{
+   int i;
+
+   if (self == NULL) {
+      pthread_mutex_lock(&slots_lock);
+      if (nfree > 0) {
+         i = free_slots[--nfree];
+      } else {
+         i = atomic_load(&nslots);
+         // further threads share the last slot, the atomic adds keep it exact
+         if (i < METRICS_SLOTS)
+            atomic_store(&nslots, i + 1);
+         else
+            i = METRICS_SLOTS - 1;
+      }
+      pthread_mutex_unlock(&slots_lock);
+      self = &slots[i];
+   }
+   return self;
+}
+
+//
+// Gives the calling thread's slot to the next thread that starts. What
+// it counted stays in the totals. Called by threads about to exit.
+//
+void metricsRelease(void)
+{
+   if (self == NULL)
+      return;
+   pthread_mutex_lock(&slots_lock);
+   // the last slot may be shared
+   if (self != &slots[METRICS_SLOTS - 1])
+      free_slots[nfree++] = self - slots;
+   pthread_mutex_unlock(&slots_lock);
+   self = NULL;
+}
+
+static void metricsInc(long long *p, long long n)
+{
+   __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+static long long metricsLoad(long long *p)
+{
+   return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+void metricsAdd(int counter, long long n)
+{
+   metricsInc(&metricsSelf()->counters[counter], n);
+}
+
+void metricsObserve(int hist, long long ns)
+{
+   metrics_hist_t *h = &metricsSelf()->hists[hist];
+   int b = 0;
+
+   while (b < METRICS_NBUCKETS && ns > bounds[b])
+      b++;
+   metricsInc(&h->buckets[b], 1);
+   metricsInc(&h->count, 1);
+   metricsInc(&h->sum_ns, ns);
+}
+
+//
+// Records that delta worker threads started, or exited if negative
+//
+void metricsWorkers(int delta)
+{
+   long long now = metricsNow();
+
+   pthread_mutex_lock(&workers_lock);
+   workers_ns += workers * (now - workers_since);
+   workers_since = now;
+   workers += delta;
+   pthread_mutex_unlock(&workers_lock);
+}
+
+//
+// Adds a gauge whose value is read when the metrics are rendered.
+// Only call this before the server starts its threads.
+//
+void metricsGauge(const char *name, const char *help, long (*read)(void))
+{
+   if (ngauges == METRICS_GAUGES)
+      app_error("too many gauges");
+   gauges[ngauges].name = name;
+   gauges[ngauges].help = help;
+   gauges[ngauges].read = read;
+   ngauges++;
+}
+
+static long long metricsCounter(int counter)
+{
+   int n = atomic_load(&nslots);
+   long long sum = 0;
+
+   for (int i = 0; i < n; i++)
+      sum += metricsLoad(&slots[i].counters[counter]);
+   return sum;
+}
+
+static void metricsRenderHist(FILE *out, int hist)
+{
+   int n = atomic_load(&nslots);
+   long long buckets[METRICS_NBUCKETS + 1] = {0}, count = 0, sum_ns = 0, cumulative = 0;
+   const char *name = hist_names[hist][0];
+   char labels[MAXLINE] = "", selector[MAXLINE] = "";
+
+   for (int i = 0; i < n; i++) {
+      metrics_hist_t *h = &slots[i].hists[hist];
+      for (int b = 0; b <= METRICS_NBUCKETS; b++)
+         buckets[b] += metricsLoad(&h->buckets[b]);
+      count += metricsLoad(&h->count);
+      sum_ns += metricsLoad(&h->sum_ns);
+   }
+
+   // queueing and service time depend on the scheduling policy
+   if (hist != METRIC_CGI_SPAWN) {
+      sprintf(labels, "policy=\"%s\",", metrics_policy);
+      sprintf(selector, "{policy=\"%s\"}", metrics_policy);
+   }
+   fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_names[hist][1], name);
+   for (int b = 0; b <= METRICS_NBUCKETS; b++) {
+      cumulative += buckets[b];
+      if (b < METRICS_NBUCKETS)
+         fprintf(out, "%s_bucket{%sle=\"%g\"} %lld\n", name, labels, bounds[b] / 1e9, cumulative);
+      else
+         fprintf(out, "%s_bucket{%sle=\"+Inf\"} %lld\n", name, labels, cumulative);
+   }
+   fprintf(out, "%s_sum%s %.9f\n", name, selector, sum_ns / 1e9);
+   fprintf(out, "%s_count%s %lld\n", name, selector, count);
+}
+
+//
+// Renders all metrics in the Prometheus text format into a malloc'd
+// string of *len bytes
+//
+char *metricsRender(int *len)
+{
+   char *text;
+   size_t size;
+   FILE *out = open_memstream(&text, &size);
+   long long now = metricsNow(), busy_ns, capacity_ns;
+   double uptime = (now - started) / 1e9;
+   int nworkers;
+
+   if (out == NULL)
+      unix_error("open_memstream error");
+
+   for (int c = 0; c < METRIC_NCOUNTERS; c++) {
+      const char *name = counter_names[c][0];
+
+      fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, counter_names[c][1], name);
+      if (c == METRIC_BUSY_NS)
+         fprintf(out, "%s %.9f\n", name, metricsCounter(c) / 1e9);
+      else
+         fprintf(out, "%s %lld\n", name, metricsCounter(c));
+   }
+   for (int h = 0; h < METRIC_NHISTS; h++)
+      metricsRenderHist(out, h);
+   for (int g = 0; g < ngauges; g++) {
+      fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", gauges[g].name, gauges[g].help, gauges[g].name);
+      fprintf(out, "%s{policy=\"%s\"} %ld\n", gauges[g].name, metrics_policy, gauges[g].read());
+   }
+
+   pthread_mutex_lock(&workers_lock);
+   nworkers = workers;
+   capacity_ns = workers_ns + workers * (now - workers_since);
+   pthread_mutex_unlock(&workers_lock);
+   busy_ns = metricsCounter(METRIC_BUSY_NS);
+   fprintf(out, "# HELP blg312e_worker_threads Worker threads running.\n");
+   fprintf(out, "# TYPE blg312e_worker_threads gauge\n");
+   fprintf(out, "blg312e_worker_threads{policy=\"%s\"} %d\n", metrics_policy, nworkers);
+   fprintf(out, "# HELP blg312e_worker_busy_ratio Share of worker time spent handling requests since start.\n");
+   fprintf(out, "# TYPE blg312e_worker_busy_ratio gauge\n");
+   fprintf(out, "blg312e_worker_busy_ratio{policy=\"%s\"} %.6f\n", metrics_policy,
+           capacity_ns > 0 ? (double)busy_ns / capacity_ns : 0.0);
+   fprintf(out, "# HELP blg312e_uptime_seconds Time since the server started.\n");
+   fprintf(out, "# TYPE blg312e_uptime_seconds gauge\n");
+   fprintf(out, "blg312e_uptime_seconds %.3f\n", uptime);
+
+   fclose(out);
+   *len = size;
+   return text;
+}
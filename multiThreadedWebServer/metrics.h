@@ -0,0 +1,47 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/*
+ * Server statistics, served at /metrics in the Prometheus text format.
+ * Every thread counts into its own cache line and the slots are only
+ * summed when the metrics are scraped.
+ */
+
+/* Counters */
+enum {
+    METRIC_ACCEPTS,        /* connections accepted */
+    METRIC_REQUESTS,       /* requests handled */
+    METRIC_BYTES_SENT,     /* bytes written to clients by the server itself */
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_STAT_HITS,      /* file lookups answered by the metadata cache */
+    METRIC_STAT_MISSES,
+    METRIC_PREFETCHED,     /* bytes of queued files read ahead */
+    METRIC_BUSY_NS,        /* time workers spent handling requests */
+    METRIC_POOL_GROWN,     /* workers started by the adaptive pool */
+    METRIC_POOL_SHRUNK,    /* surplus workers that exited */
+    METRIC_REJECTED,       /* connections turned away at accept */
+    METRIC_SHED,           /* requests answered 503 instead of served */
+    METRIC_NCOUNTERS
+};
+
+/* Histograms of durations */
+enum {
+    METRIC_QUEUE_WAIT,     /* from enqueue until a worker took the request */
+    METRIC_SERVICE,        /* time a worker spent on the request */
+    METRIC_CGI_SPAWN,      /* starting a CGI process */
+    METRIC_NHISTS
+};
+
+#define METRICS_URI "/metrics"
+
+void metricsInit(const char *policy);
+long long metricsNow(void);
+void metricsWorkers(int delta);
+void metricsRelease(void);
+void metricsAdd(int counter, long long n);
+void metricsObserve(int hist, long long ns);
+void metricsGauge(const char *name, const char *help, long (*read)(void));
+char *metricsRender(int *len);
+
+#endif
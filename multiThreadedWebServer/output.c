@@ -1,4 +1,5 @@
 #include "blg312e.h"
+#include "cgi.h"
 #include <sys/time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -34,11 +35,10 @@ double Time_GetSeconds() {
 }
 
 
-int main(int argc, char *argv[])
+void respond()
 {
   char content[MAXBUF];
-
-  getargs();
+  int len;
 
   double t1 = Time_GetSeconds();
   while ((Time_GetSeconds() - t1) < spinfor){
@@ -47,16 +47,82 @@ int main(int argc, char *argv[])
   double t2 = Time_GetSeconds();
   
   /* Make the response body */
-  sprintf(content, "<p>Welcome to the CGI program</p>\r\n");
-  sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-  sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+  len = snprintf(content, MAXBUF, "<p>Welcome to the CGI program</p>\r\n");
+  len += snprintf(content + len, MAXBUF - len, "<p>My only purpose is to waste time on the server!</p>\r\n");
+  snprintf(content + len, MAXBUF - len, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
   
   /* Generate the HTTP response */
   printf("Content-length: %lu\r\n", strlen(content));
   printf("Content-type: text/html\r\n\r\n");
   printf("%s", content);
   fflush(stdout);
+}
 
-  exit(0);
+//
+// Persistent mode for the server's CGI process pool (see cgi.h):
+// answers requests passed in over CGI_POOL_FD until the server goes away.
+//
+void serve_pool()
+{
+  char query[MAXBUF], control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int clientfd, devnull;
+  ssize_t n, querylen;
+
+  /* stdout is /dev/null between requests */
+  devnull = dup(STDOUT_FILENO);
+
+  /* tell the server we are ready */
+  if (send(CGI_POOL_FD, "r", 1, 0) != 1)
+    return;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = query;
+    iov.iov_len = sizeof(query) - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(CGI_POOL_FD, &msg, 0)) <= 0)
+      return;
+    query[n] = '\0';
+    /* the server's part of the header follows the query string */
+    querylen = strlen(query);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    memcpy(&clientfd, CMSG_DATA(cmsg), sizeof(int));
+
+    setenv("QUERY_STRING", query, 1);
+    spinfor = 5.0;
+    getargs();
+
+    dup2(clientfd, STDOUT_FILENO);
+    close(clientfd);
+    if (querylen < n)
+      fputs(query + querylen + 1, stdout);
+    respond();
+    /* let go of the client socket so the connection can close */
+    dup2(devnull, STDOUT_FILENO);
+
+    if (send(CGI_POOL_FD, "d", 1, 0) != 1)
+      return;
+  }
 }
 
+int main(int argc, char *argv[])
+{
+  if (getenv(CGI_POOL_ENV) != NULL) {
+    serve_pool();
+    exit(0);
+  }
+
+  getargs();
+  respond();
+
+  exit(0);
+}
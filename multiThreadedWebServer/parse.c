@@ -0,0 +1,237 @@
+//
+// parse.c: Finds and splits up HTTP request heads in the receive buffer.
+//
+// The hot part is looking for the "\r\n\r\n" that ends a head, which is
+// done on every read. On x86 it compares 16 (SSE2) or 32 (AVX2) positions
+// at once, using whichever the CPU has; elsewhere, or until parseSetup
+// has run, a byte at a time. Once the head is complete it is split into
+// the request line and header lines in a single pass.
+//
+
+#include "blg312e.h"
+#include "parse.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PARSE_X86
+#include <immintrin.h>
+#endif
+
+//
+// Returns the length of the head, up to and including the "\r\n\r\n"
+// ending it, if one starts at or after from, else 0. Every start before
+// len - 3 is checked.
+//
+static int headEndScalar(const char *buf, int from, int len)
+{
+   int i;
+
+   for (i = from; i + 3 < len; i++) {
+      if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n')
+         return i + 4;
+   }
+   return 0;
+}
+
+#ifdef PARSE_X86
+//
+// Like headEndScalar. The four loads, shifted by a byte each, put the
+// bytes that would make up the ending side by side, so one AND of four
+// compares checks 16 starting positions.
+//
+static int headEndSse2(const char *buf, int from, int len)
+{
+   const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+   __m128i a, b, c, d;
+   unsigned mask;
+   int i;
+
+   for (i = from; i + 3 + 16 <= len; i += 16) {
+      a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), cr);
+      b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 1)), lf);
+      c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 2)), cr);
+      d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 3)), lf);
+      mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d)));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) + 4;
+   }
+   return headEndScalar(buf, i, len);
+}
+
+//
+// headEndSse2 with 32 positions at a time
+//
+__attribute__((target("avx2")))
+static int headEndAvx2(const char *buf, int from, int len)
+{
+   const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+   __m256i a, b, c, d;
+   unsigned mask;
+   int i;
+
+   for (i = from; i + 3 + 32 <= len; i += 32) {
+      a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), cr);
+      b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 1)), lf);
+      c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 2)), cr);
+      d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 3)), lf);
+      mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d)));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) + 4;
+   }
+   // the tail is SSE code, which would run slowly with the upper halves
+   // of the AVX registers still in use
+   _mm256_zeroupper();
+   return headEndSse2(buf, i, len);
+}
+#endif
+
+typedef struct {
+   const char *name;
+   int (*head_end)(const char *buf, int from, int len);
+} parse_impl_t;
+
+// fastest first
+static const parse_impl_t impls[] = {
+#ifdef PARSE_X86
+   {"avx2", headEndAvx2},
+   {"sse2", headEndSse2},
+#endif
+   {"scalar", headEndScalar},
+};
+#define NIMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const parse_impl_t *impl = &impls[NIMPLS - 1];
+
+static int parseSupported(const parse_impl_t *candidate)
+{
+#ifdef PARSE_X86
+   __builtin_cpu_init();
+   if (!strcmp(candidate->name, "avx2"))
+      return __builtin_cpu_supports("avx2");
+#endif
+   return 1;
+}
+
+//
+// Picks the fastest implementation the CPU supports. Called once at
+// startup, before any thread parses.
+//
+void parseSetup(void)
+{
+   int i;
+
+   for (i = 0; i < NIMPLS && !parseSupported(&impls[i]); i++)
+      ;
+   impl = &impls[i];
+}
+
+//
+// Uses the implementation called name. Returns -1 if there is no such
+// implementation or the CPU does not support it.
+//
+int parseUse(const char *name)
+{
+   int i;
+
+   for (i = 0; i < NIMPLS; i++) {
+      if (!strcmp(impls[i].name, name) && parseSupported(&impls[i])) {
+         impl = &impls[i];
+         return 0;
+      }
+   }
+   return -1;
+}
+
+const char *parseName(void)
+{
+   return impl->name;
+}
+
+//
+// Starts over with a new head at the start of the buffer
+//
+void parseInit(parse_t *parse)
+{
+   parse->scanned = 0;
+   parse->nheaders = 0;
+}
+
+//
+// Returns the length of the request head at the start of buf, up to and
+// including the empty line that ends it, or 0 if buf does not hold all of
+// it yet. Only the bytes added since the last call are searched.
+//
+int parseHeadLength(parse_t *parse, const char *buf, int len)
+{
+   int headlen = impl->head_end(buf, parse->scanned, len);
+
+   if (headlen == 0 && len > 3)
+      parse->scanned = len - 3;
+   return headlen;
+}
+
+//
+// Returns the next space separated token of the request line, from *p up
+// to end. An empty token sits at end.
+//
+static parse_span_t parseToken(const char *buf, int *p, int end)
+{
+   parse_span_t token;
+   int i = *p;
+
+   while (i < end && buf[i] == ' ')
+      i++;
+   token.off = i;
+   while (i < end && buf[i] != ' ')
+      i++;
+   token.len = i - token.off;
+   *p = i;
+   return token;
+}
+
+//
+// Splits up the complete head of headlen bytes at the start of buf into
+// the request line, its method, URI and version, and the header lines,
+// each a name and a value with surrounding whitespace removed. Lines
+// without a colon are skipped. Returns -1 if there are more than
+// PARSE_MAXHEADERS header lines.
+//
+int parseHead(parse_t *parse, const char *buf, int headlen)
+{
+   const char *p, *end = buf + headlen - 2, *nl, *colon, *v, *vend;
+   parse_header_t *header;
+   int i;
+
+   // the request line ends at the first line ending
+   nl = memchr(buf, '\n', headlen);
+   parse->line.off = 0;
+   parse->line.len = nl - buf;
+   if (parse->line.len > 0 && buf[parse->line.len - 1] == '\r')
+      parse->line.len--;
+   i = 0;
+   parse->method = parseToken(buf, &i, parse->line.len);
+   parse->uri = parseToken(buf, &i, parse->line.len);
+   parse->version = parseToken(buf, &i, parse->line.len);
+
+   parse->nheaders = 0;
+   for (p = nl + 1; p < end; p = nl + 1) {
+      nl = memchr(p, '\n', end - p);
+      if (nl == NULL)
+         nl = end;
+      if ((colon = memchr(p, ':', nl - p)) == NULL)
+         continue;
+      if (parse->nheaders == PARSE_MAXHEADERS)
+         return -1;
+      v = colon + 1;
+      vend = nl;
+      while (v < vend && (*v == ' ' || *v == '\t'))
+         v++;
+      while (vend > v && (vend[-1] == '\r' || vend[-1] == ' ' || vend[-1] == '\t'))
+         vend--;
+      header = &parse->headers[parse->nheaders++];
+      header->name.off = p - buf;
+      header->name.len = colon - p;
+      header->value.off = v - buf;
+      header->value.len = vend - v;
+   }
+   return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+/* Most header lines a request may have */
+#define PARSE_MAXHEADERS 64
+
+/* Where something is in the buffer being parsed. Offsets rather than
+   pointers, so they survive the buffer being realloc'd. */
+typedef struct {
+    int off;
+    int len;
+} parse_span_t;
+
+typedef struct {
+    parse_span_t name, value;
+} parse_header_t;
+
+/*
+ * An HTTP request head parsed in place in the receive buffer: nothing is
+ * copied or allocated. The search for the end of the head resumes where
+ * the previous one stopped, so a head arriving in many small reads is
+ * still only scanned once.
+ */
+typedef struct {
+    int scanned;   /* bytes known not to start the empty line ending the head */
+
+    parse_span_t line;   /* request line, without its line ending */
+    parse_span_t method, uri, version;
+    parse_header_t headers[PARSE_MAXHEADERS];
+    int nheaders;
+} parse_t;
+
+void parseSetup(void);
+int parseUse(const char *name);
+const char *parseName(void);
+void parseInit(parse_t *parse);
+int parseHeadLength(parse_t *parse, const char *buf, int len);
+int parseHead(parse_t *parse, const char *buf, int headlen);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * parsebench.c: Times the request head parser.
+ *
+ * Every implementation the CPU supports parses a few typical request
+ * heads, first arriving whole, then in reads of 64 bytes each, where the
+ * search for the end of the head either resumes or, as a parser without
+ * state has to, starts over on every read. Reports nanoseconds per head.
+ *
+ * Usage: ./parsebench [iterations]   (default 1000000, fewer for larger
+ *        heads and for restarting, which is quadratic in the head size)
+ */
+#include "blg312e.h"
+#include "parse.h"
+#include <time.h>
+
+#define CHUNK 64
+
+static char curl_head[] =
+  "GET /files/file1.txt HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/7.88.1\r\n"
+  "Accept: */*\r\n"
+  "\r\n";
+
+static char browser_head[] =
+  "GET /home.html HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: none\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-User: ?1\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Accept-Language: en-US,en;q=0.9,tr;q=0.8\r\n"
+  "If-None-Match: \"f7-61c2f1d0a4b80\"\r\n"
+  "If-Modified-Since: Sat, 04 May 2024 10:11:12 GMT\r\n"
+  "\r\n";
+
+typedef struct {
+  char *name;
+  char *head;
+  int len;
+} sample_t;
+
+static volatile int sink;
+
+double now_ns()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*
+ * Parses head iters times, arriving in reads of chunk bytes (0 for all at
+ * once). Without resume the search starts over on every read.
+ */
+double run(char *head, int len, int chunk, int resume, long iters)
+{
+  parse_t parse;
+  double start = now_ns();
+  int got, headlen;
+
+  for (long i = 0; i < iters; i++) {
+    parseInit(&parse);
+    got = chunk > 0 ? 0 : len;
+    do {
+      if (chunk > 0)
+        got = got + chunk < len ? got + chunk : len;
+      if (!resume)
+        parse.scanned = 0;
+    } while ((headlen = parseHeadLength(&parse, head, got)) == 0);
+    parseHead(&parse, head, headlen);
+    sink += parse.nheaders;
+  }
+  return (now_ns() - start) / iters;
+}
+
+int main(int argc, char *argv[])
+{
+  char *impls[] = {"scalar", "sse2", "avx2"};
+  long iters = argc > 1 ? atol(argv[1]) : 1000000;
+  sample_t samples[3];
+  char *large;
+  int n = 0;
+
+  /* a head with lots of cookies, near MAXBUF */
+  large = malloc(MAXBUF);
+  n = sprintf(large, "GET /files/file1.txt HTTP/1.1\r\nHost: localhost:8080\r\nCookie: ");
+  while (n < MAXBUF - 200)
+    n += sprintf(large + n, "session%d=%08x; ", n, n * 2654435761u);
+  n += sprintf(large + n, "\r\nAccept: */*\r\n\r\n");
+
+  samples[0] = (sample_t){"curl", curl_head, sizeof(curl_head) - 1};
+  samples[1] = (sample_t){"browser", browser_head, sizeof(browser_head) - 1};
+  samples[2] = (sample_t){"cookies", large, n};
+
+  parseSetup();
+  printf("default implementation: %s\n\n", parseName());
+  printf("%8s %8s %6s %10s %14s %14s\n", "impl", "head", "bytes", "whole ns", "resumed ns", "restarted ns");
+  for (int i = 0; i < 3; i++) {
+    if (parseUse(impls[i]) < 0)
+      continue;
+    for (int s = 0; s < 3; s++) {
+      sample_t *sample = &samples[s];
+      long scaled = iters * 128 / sample->len + 1;
+
+      printf("%8s %8s %6d %10.1f %14.1f %14.1f\n", impls[i], sample->name, sample->len,
+             run(sample->head, sample->len, 0, 1, scaled),
+             run(sample->head, sample->len, CHUNK, 1, scaled),
+             run(sample->head, sample->len, CHUNK, 0, scaled / (sample->len / CHUNK + 1) + 1));
+    }
+  }
+  free(large);
+  return 0;
+}
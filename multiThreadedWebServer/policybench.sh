@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# policybench.sh: Compares the scheduling policies under the same load.
+#
+# Creates files of three sizes under bench-files/, then for every policy
+# starts the server, runs ./bench in open loop against a mix of mostly
+# small and a few large files, and prints its throughput and latency.
+#
+# Usage: ./policybench.sh [rps] [seconds] [threads]
+#        (default 400 requests/s for 10 s on a server with 2 threads)
+#
+RPS=${1:-400}
+SECONDS_PER_RUN=${2:-10}
+THREADS=${3:-2}
+PORT=${PORT:-8099}
+POLICIES=${POLICIES:-"FIFO SFF RFF ASFF SRPT WFQ"}
+
+mkdir -p bench-files
+[ -f bench-files/small ] || head -c 1024 /dev/urandom > bench-files/small
+[ -f bench-files/medium ] || head -c 102400 /dev/urandom > bench-files/medium
+[ -f bench-files/large ] || head -c 8388608 /dev/urandom > bench-files/large
+
+cat > bench-files/workload.txt <<EOF
+80 /bench-files/small
+17 /bench-files/medium
+3 /bench-files/large
+EOF
+
+for policy in $POLICIES; do
+  ./server $PORT $THREADS 256 $policy -v 0 &
+  pid=$!
+  sleep 0.5
+  echo "== $policy"
+  ./bench -c 64 -d $SECONDS_PER_RUN -r $RPS -w bench-files/workload.txt localhost $PORT | tail -n +3
+  kill $pid
+  wait $pid 2>/dev/null
+done
@@ -0,0 +1,88 @@
+//
+// pqueue.c: Binary heap backing the request buffer.
+//
+// Push and pop are O(log n), so picking the next request under SFF or RFF
+// no longer scans the whole buffer.
+//
+
+#include "blg312e.h"
+#include "pqueue.h"
+
+void pqueueInit(pqueue_t *pq, int cap)
+{
+   pq->heap = (pqueue_entry_t*)malloc(sizeof(pqueue_entry_t) * cap);
+   pq->size = 0;
+   pq->cap = cap;
+   pq->seq = 0;
+}
+
+void pqueueDestroy(pqueue_t *pq)
+{
+   free(pq->heap);
+   pq->heap = NULL;
+   pq->size = pq->cap = 0;
+}
+
+static int pqueueLess(pqueue_entry_t *a, pqueue_entry_t *b)
+{
+   if (a->key != b->key)
+      return a->key < b->key;
+   return a->seq < b->seq;
+}
+
+//
+// Adds request with the given key, growing the heap when it is full
+//
+void pqueuePush(pqueue_t *pq, long long key, request_t *request)
+{
+   pqueue_entry_t entry;
+   int i, parent;
+
+   if (pq->size == pq->cap) {
+      pq->cap = pq->cap ? 2 * pq->cap : 16;
+      pq->heap = (pqueue_entry_t*)realloc(pq->heap, sizeof(pqueue_entry_t) * pq->cap);
+   }
+
+   entry.key = key;
+   entry.seq = pq->seq++;
+   entry.request = request;
+
+   // sift up
+   i = pq->size++;
+   while (i > 0) {
+      parent = (i - 1) / 2;
+      if (!pqueueLess(&entry, &pq->heap[parent]))
+         break;
+      pq->heap[i] = pq->heap[parent];
+      i = parent;
+   }
+   pq->heap[i] = entry;
+}
+
+//
+// Removes and returns the request with the smallest key, NULL if empty
+//
+request_t *pqueuePop(pqueue_t *pq)
+{
+   pqueue_entry_t last;
+   request_t *top;
+   int i, child;
+
+   if (pq->size == 0)
+      return NULL;
+   top = pq->heap[0].request;
+   last = pq->heap[--pq->size];
+
+   // sift the last entry down from the root
+   i = 0;
+   while ((child = 2 * i + 1) < pq->size) {
+      if (child + 1 < pq->size && pqueueLess(&pq->heap[child + 1], &pq->heap[child]))
+         child++;
+      if (!pqueueLess(&pq->heap[child], &last))
+         break;
+      pq->heap[i] = pq->heap[child];
+      i = child;
+   }
+   pq->heap[i] = last;
+   return top;
+}
@@ -0,0 +1,29 @@
+#ifndef __PQUEUE_H__
+#define __PQUEUE_H__
+
+#include "request.h"
+
+/*
+ * Binary min-heap of requests used as the request buffer.
+ * Entries are ordered by key and, for equal keys, by insertion order,
+ * so a constant key gives FIFO behaviour.
+ */
+typedef struct {
+    long long key;
+    unsigned long seq;
+    request_t *request;
+} pqueue_entry_t;
+
+typedef struct {
+    pqueue_entry_t *heap;
+    int size;
+    int cap;
+    unsigned long seq;   /* insertion counter */
+} pqueue_t;
+
+void pqueueInit(pqueue_t *pq, int cap);
+void pqueueDestroy(pqueue_t *pq);
+void pqueuePush(pqueue_t *pq, long long key, request_t *request);
+request_t *pqueuePop(pqueue_t *pq);
+
+#endif
@@ -0,0 +1,187 @@
+//
+// prefetch.c: Reads the files of queued requests into the page cache
+// while the requests wait for a worker.
+//
+// Queued static requests are candidates, and a thread of its own asks the
+// kernel to read ahead the one the scheduling policy will dispatch first,
+// going by the same key as the queues, as long as the files read ahead
+// but not yet served stay within prefetch_budget. The workers then find
+// their files in memory instead of waiting for the disk. Files small
+// enough for the response cache are left to it. A file the metadata cache
+// did not know is stat()ed by the thread too, which spares the worker.
+//
+
+#include "blg312e.h"
+#include "prefetch.h"
+#include "cache.h"
+#include "statcache.h"
+#include "metrics.h"
+
+#define PREFETCH_MAX 1024   // candidates, beyond that requests are not read ahead
+
+// request->prefetch
+enum { PREFETCH_NONE, PREFETCH_QUEUED, PREFETCH_READ };
+
+size_t prefetch_budget = 0;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static request_t *candidates[PREFETCH_MAX];
+static int ncandidates;
+static size_t inflight;   // bytes read ahead for requests not taken yet
+static request_t *reading;   // the request the thread is working on, until it is taken
+
+//
+// Returns 1 if a comes before b in the queues: smaller key, then queued
+// earlier
+//
+static int prefetchBefore(request_t *a, request_t *b)
+{
+   if (a->queue_key != b->queue_key)
+      return a->queue_key < b->queue_key;
+   return a->queued_at < b->queued_at;
+}
+
+static void prefetchRemove(int i)
+{
+   candidates[i] = candidates[--ncandidates];
+}
+
+//
+// Returns the index of the candidate dispatched first, or -1 if it does
+// not fit into what is left of the budget
+//
+static int prefetchNext(void)
+{
+   int i, first = -1;
+
+   for (i = 0; i < ncandidates; i++) {
+      if (first < 0 || prefetchBefore(candidates[i], candidates[first]))
+         first = i;
+   }
+   if (first >= 0 && candidates[first]->stat_return == 0 &&
+       inflight + candidates[first]->sbuf.st_size > prefetch_budget)
+      return -1;
+   return first;
+}
+
+//
+// Returns 1 if the file stat()ed into sbuf is worth reading ahead
+//
+static int prefetchWorth(struct stat *sbuf)
+{
+   return S_ISREG(sbuf->st_mode) && sbuf->st_size > 0 && sbuf->st_size <= prefetch_budget &&
+          !cacheFits(cache_files, sbuf->st_size);
+}
+
+static void *prefetchThread(void *arg)
+{
+   char path[MAXLINE];
+   struct stat sbuf;
+   request_t *request;
+   off_t size;
+   int i, fd;
+
+   pthread_mutex_lock(&prefetch_lock);
+   while (1) {
+      if ((i = prefetchNext()) < 0) {
+         pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+         continue;
+      }
+      request = candidates[i];
+      prefetchRemove(i);
+      request->prefetch = PREFETCH_READ;
+      request->prefetched = 0;
+      reading = request;
+      sbuf = request->sbuf;
+      if (request->stat_return != 0)
+         sbuf.st_mode = 0;
+      snprintf(path, sizeof(path), "%s", request->filename.ptr);
+      pthread_mutex_unlock(&prefetch_lock);
+
+      if (sbuf.st_mode == 0 && statCacheStat(path, &sbuf) < 0)
+         sbuf.st_mode = 0;
+
+      // charged now, unless a worker took the request meanwhile; the
+      // worker taking it gives the bytes back
+      pthread_mutex_lock(&prefetch_lock);
+      size = sbuf.st_size;
+      if (reading != request || !prefetchWorth(&sbuf) || inflight + size > prefetch_budget) {
+         reading = NULL;
+         continue;
+      }
+      reading = NULL;
+      request->prefetched = size;
+      inflight += size;
+      pthread_mutex_unlock(&prefetch_lock);
+
+      // starts reading and returns, the request is not touched again
+      if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+         posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+         Close(fd);
+         metricsAdd(METRIC_PREFETCHED, size);
+      }
+      pthread_mutex_lock(&prefetch_lock);
+   }
+   return NULL;
+}
+
+void prefetchInit(void)
+{
+   pthread_t tid;
+
+   if (prefetch_budget == 0)
+      return;
+   pthread_create(&tid, NULL, prefetchThread, NULL);
+   pthread_detach(tid);
+}
+
+//
+// Makes a request being queued, with its key set, a candidate for reading
+// ahead. Must be called before a worker can take it.
+//
+void prefetchAdd(request_t *request)
+{
+   request->prefetch = PREFETCH_NONE;
+   if (prefetch_budget == 0 || !request->is_static ||
+       (request->stat_return != STAT_MISS &&
+        (request->stat_return < 0 || !prefetchWorth(&request->sbuf))))
+      return;
+
+   pthread_mutex_lock(&prefetch_lock);
+   if (ncandidates < PREFETCH_MAX) {
+      candidates[ncandidates++] = request;
+      request->prefetch = PREFETCH_QUEUED;
+      pthread_cond_signal(&prefetch_cond);
+   }
+   pthread_mutex_unlock(&prefetch_lock);
+}
+
+//
+// Called by the worker that took the request from the queue: it is no
+// longer a candidate, and what was read ahead for it leaves the budget
+//
+void prefetchDone(request_t *request)
+{
+   int i;
+
+   if (prefetch_budget == 0)
+      return;
+   pthread_mutex_lock(&prefetch_lock);
+   if (request->prefetch == PREFETCH_NONE) {
+      pthread_mutex_unlock(&prefetch_lock);
+      return;
+   }
+   if (request->prefetch == PREFETCH_QUEUED) {
+      for (i = 0; candidates[i] != request; i++)
+         ;
+      prefetchRemove(i);
+   } else {
+      if (reading == request)
+         reading = NULL;
+      inflight -= request->prefetched;
+      pthread_cond_signal(&prefetch_cond);
+   }
+   request->prefetch = PREFETCH_NONE;
+   pthread_mutex_unlock(&prefetch_lock);
+}
@@ -0,0 +1,13 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "request.h"
+
+/* Bytes of queued files read ahead and not yet served, 0 disables it */
+extern size_t prefetch_budget;
+
+void prefetchInit(void);
+void prefetchAdd(request_t *request);
+void prefetchDone(request_t *request);
+
+#endif
@@ -2,53 +2,398 @@
 // request.c: Does the bulk of the work for the web server.
 // 
 
+#define _GNU_SOURCE
 #include "blg312e.h"
 #include "request.h"
+#include "cache.h"
+#include "cgi.h"
+#include "metrics.h"
+#include "log.h"
+#include "statcache.h"
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <zlib.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 
-// requestError(      fd,    filename,        "404",    "Not found", "blg312e Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+int keepalive_max = 100;
+int static_mode = STATIC_MMAP;
+off_t static_slice = 0;
+off_t static_async_min = 0;
+
+static atomic_int nrequests;   // request_t's allocated, one per open connection
+
+#define VALIDATOR_LEN 64   // an ETag or Last-Modified value
+#define GZIP_MIN 256       // smaller files are not worth compressing on the fly
+#define RESPONSE_IOV 8     // pieces of a response, see response_t
+
+// Content codings, with the suffix of precompressed files
+enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BR };
+static const char *encoding_names[] = {"identity", "gzip", "br"};
+static const char *encoding_suffixes[] = {"", ".gz", ".br"};
+
+//
+// Writes to the client. A failed write means the client is gone, which only
+// ends this connection instead of the whole server.
+//
+static void requestWrite(request_t *request, void *buf, size_t n)
 {
-   char buf[MAXLINE], body[MAXBUF];
+   if (rio_writen(request->connfd, buf, n) < 0) {
+      request->keep_alive = 0;
+      return;
+   }
+   request->sent += n;
+   metricsAdd(METRIC_BYTES_SENT, n);
+}
 
-   // Create the body of the error message
-   sprintf(body, "<html><title>blg312e Error</title>");
-   sprintf(body, "%s<body bgcolor=""fffff"">\r\n", body);
-   sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-   sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-   sprintf(body, "%s<hr>blg312e Web Server\r\n", body);
+//
+// A response put together from pieces and sent with a single sendmsg(2)
+// as long as the socket takes it all. Header lines are formatted into buf;
+// anything else, like a cached header or a body, is only pointed to.
+//
+typedef struct {
+   char buf[MAXLINE];
+   int len;
+   struct iovec iov[RESPONSE_IOV];
+   int iovcnt;
+} response_t;
+
+static void responseInit(response_t *response)
+{
+   response->len = 0;
+   response->iovcnt = 0;
+}
+
+//
+// Adds the n bytes at data to the response without copying them; they
+// must stay put until it is sent
+//
+static void responseAdd(response_t *response, void *data, size_t n)
+{
+   struct iovec *last;
+
+   if (n == 0)
+      return;
+   if (response->iovcnt > 0) {
+      // text formatted right after the last piece just extends it
+      last = &response->iov[response->iovcnt - 1];
+      if ((char*)last->iov_base + last->iov_len == (char*)data) {
+         last->iov_len += n;
+         return;
+      }
+   }
+   if (response->iovcnt == RESPONSE_IOV)
+      app_error("response_t has too many pieces");
+   response->iov[response->iovcnt].iov_base = data;
+   response->iov[response->iovcnt].iov_len = n;
+   response->iovcnt++;
+}
+
+//
+// Formats more header text into the response. Whatever does not fit into
+// MAXLINE is cut off.
+//
+static void responsePrintf(response_t *response, const char *fmt, ...)
+{
+   char *p = response->buf + response->len;
+   int room = sizeof(response->buf) - response->len, n;
+   va_list ap;
+
+   va_start(ap, fmt);
+   n = vsnprintf(p, room, fmt, ap);
+   va_end(ap);
+   if (n >= room)
+      n = room - 1;
+   response->len += n;
+   responseAdd(response, p, n);
+}
+
+//
+// Sends the response, with send(2) flags: MSG_MORE holds the last segment
+// back for what the caller sends next. Only a full socket buffer makes it
+// take more than one call.
+//
+static void responseSend(request_t *request, response_t *response, int flags)
+{
+   struct iovec *iov = response->iov;
+   struct msghdr msg;
+   ssize_t n;
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = iov;
+   msg.msg_iovlen = response->iovcnt;
+   while (msg.msg_iovlen > 0) {
+      if ((n = sendmsg(request->connfd, &msg, flags)) < 0) {
+         if (errno == EINTR)
+            continue;
+         request->keep_alive = 0;
+         return;
+      }
+      request->sent += n;
+      metricsAdd(METRIC_BYTES_SENT, n);
+      // skip what was sent
+      while (msg.msg_iovlen > 0 && n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         msg.msg_iovlen--;
+      }
+      if (msg.msg_iovlen > 0) {
+         iov->iov_base = (char*)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+      msg.msg_iov = iov;
+   }
+}
 
-   // Write out the header information for this response
-   sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+static char *requestConnection(request_t *request)
+{
+   return request->keep_alive ? "keep-alive" : "close";
+}
 
-   sprintf(buf, "Content-Type: text/html\r\n");
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+// requestError( request,    filename,        "404",    "Not found", "blg312e Server could not find this file");
+void requestError(request_t *request, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+{
+   response_t response;
+   char body[MAXBUF];
+   int len;
 
-   sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+   request->status = atoi(errnum);
 
-   // Write out the content
-   Rio_writen(fd, body, strlen(body));
-   printf("%s", body);
+   // Create the body of the error message
+   len = snprintf(body, sizeof(body), "<html><title>blg312e Error</title>"
+                                      "<body bgcolor=""fffff"">\r\n"
+                                      "%s: %s\r\n"
+                                      "<p>%s: %s\r\n"
+                                      "<hr>blg312e Web Server\r\n", errnum, shortmsg, longmsg, cause);
+   if (len >= (int)sizeof(body))
+      len = sizeof(body) - 1;
 
+   // header and content leave in one go
+   responseInit(&response);
+   responsePrintf(&response, "HTTP/1.1 %s %s\r\n"
+                             "Content-Type: text/html\r\n"
+                             "Connection: %s\r\n"
+                             "Content-Length: %d\r\n\r\n", errnum, shortmsg, requestConnection(request), len);
+   responseAdd(&response, body, len);
+   responseSend(request, &response, 0);
 }
 
 
 //
-// Reads and discards everything up to an empty text line
+// Turns the client away with an empty 503 that asks it to come back later.
+// Costs a single write; the caller closes the connection.
 //
-void requestReadhdrs(rio_t *rp)
+void requestReject(request_t *request)
 {
    char buf[MAXLINE];
 
-   Rio_readlineb(rp, buf, MAXLINE);
-   while (strcmp(buf, "\r\n")) {
-      Rio_readlineb(rp, buf, MAXLINE);
+   request->status = 503;
+   request->keep_alive = 0;
+   sprintf(buf, "HTTP/1.1 503 Service Unavailable\r\n"
+                "Server: blg312e Web Server\r\n"
+                "Retry-After: %d\r\n"
+                "Content-Length: 0\r\n"
+                "Connection: close\r\n\r\n", REQUEST_RETRY_AFTER);
+   requestWrite(request, buf, strlen(buf));
+}
+
+//
+// Returns the length of the request line plus headers, up to and including
+// the empty line that ends them, or 0 if the buffer does not hold all of
+// it yet. Only what was read since the last call is searched.
+//
+int requestHeadLength(request_t *request)
+{
+   return parseHeadLength(&request->parse, request->buf, request->len);
+}
+
+//
+// Allocates an empty request for connfd
+//
+request_t *requestNew(int connfd)
+{
+   request_t *request = (request_t*)malloc(sizeof(request_t));
+
+   request->connfd = connfd;
+   request->len = 0;
+   request->headlen = 0;
+   parseInit(&request->parse);
+   request->keep_alive = 0;
+   request->nrequests = 0;
+   request->loop = NULL;
+   request->body_fd = -1;
+   request->prefetch = 0;
+   request->prev = request->next = NULL;
+   request->cap = REQUEST_INITBUF;
+   request->buf = (char*)malloc(request->cap);
+   atomic_fetch_add(&nrequests, 1);
+   return request;
+}
+
+//
+// Returns the number of connections the server holds a request for
+//
+long requestCount(void)
+{
+   return atomic_load(&nrequests);
+}
+
+//
+// Doubles the request buffer, up to MAXBUF.
+// Returns 0 if it is already that large.
+//
+int requestGrow(request_t *request)
+{
+   if (request->cap >= MAXBUF)
+      return 0;
+   request->cap *= 2;
+   if (request->cap > MAXBUF)
+      request->cap = MAXBUF;
+   request->buf = (char*)realloc(request->buf, request->cap);
+   return 1;
+}
+
+void requestFree(request_t *request)
+{
+   if (request->body_fd >= 0)
+      Close(request->body_fd);
+   free(request->buf);
+   free(request);
+   atomic_fetch_sub(&nrequests, 1);
+}
+
+//
+// Drops the request head that was just handled, keeping any pipelined bytes
+// that followed it. Returns 1 if they already hold the next complete head.
+//
+int requestNext(request_t *request)
+{
+   request->len -= request->headlen;
+   memmove(request->buf, request->buf + request->headlen, request->len);
+   request->buf[request->len] = '\0';
+   parseInit(&request->parse);
+   request->headlen = requestHeadLength(request);
+   return request->headlen > 0;
+}
+
+//
+// Returns the value of the first header called name, with surrounding
+// whitespace removed, or a NULL ptr if the request has no such header
+//
+str_t requestHeader(request_t *request, const char *name)
+{
+   str_t value = {NULL, 0};
+   int namelen = strlen(name), i;
+   parse_header_t *header;
+
+   for (i = 0; i < request->parse.nheaders; i++) {
+      header = &request->parse.headers[i];
+      if (header->name.len == namelen && !strncasecmp(request->buf + header->name.off, name, namelen)) {
+         value.ptr = request->buf + header->value.off;
+         value.len = header->value.len;
+         break;
+      }
    }
-   return;
+   return value;
+}
+
+//
+// Returns 1 if the comma separated list value contains token
+//
+static int requestHasToken(str_t value, const char *token)
+{
+   int toklen = strlen(token);
+   char *p = value.ptr, *end = value.ptr + value.len, *item;
+
+   while (p < end) {
+      while (p < end && (*p == ' ' || *p == ','))
+         p++;
+      item = p;
+      while (p < end && *p != ',' && *p != ' ')
+         p++;
+      if (p - item == toklen && !strncasecmp(item, token, toklen))
+         return 1;
+   }
+   return 0;
+}
+
+//
+// Decides whether the connection stays open after this request: HTTP/1.1
+// defaults to keep-alive and HTTP/1.0 to close, unless the Connection header
+// says otherwise. Requests with a body are not read past, so they close too.
+//
+static int requestKeepAlive(request_t *request)
+{
+   str_t connection = requestHeader(request, "Connection");
+   str_t length = requestHeader(request, "Content-Length");
+
+   if (request->nrequests >= keepalive_max)
+      return 0;
+   if (requestHeader(request, "Transfer-Encoding").ptr || (length.ptr && atoi(length.ptr) != 0))
+      return 0;
+   if (connection.ptr && requestHasToken(connection, "close"))
+      return 0;
+   if (!strcmp(request->version.ptr, "HTTP/1.1"))
+      return 1;
+   return connection.ptr && requestHasToken(connection, "keep-alive");
+}
+
+//
+// Points token at span of the request line and NUL-terminates it there
+//
+static void requestToken(request_t *request, str_t *token, parse_span_t span)
+{
+   token->ptr = request->buf + span.off;
+   token->len = span.len;
+   token->ptr[token->len] = '\0';
+}
+
+//
+// Fills in request from the complete request head at the start of its
+// buffer (see requestHeadLength). The request line is split in place and
+// filename and cgiargs are stored right after the data read so far.
+// The headers stay in place for requestHeader.
+//
+void requestParseHead(request_t *request)
+{
+   int linelen;
+
+   request->bad_head = parseHead(&request->parse, request->buf, request->headlen) < 0;
+   linelen = request->parse.line.len;
+
+   // room for the filename ("." uri "home.html") and cgiargs after the data
+   while (request->cap < request->len + 2 * linelen + 16)
+      request->cap *= 2;
+   request->buf = (char*)realloc(request->buf, request->cap);
+
+   // the method and URI end at a space, the version at the line ending
+   requestToken(request, &request->method, request->parse.method);
+   requestToken(request, &request->uri, request->parse.uri);
+   requestToken(request, &request->version, request->parse.version);
+   request->nrequests++;
+   request->keep_alive = !request->bad_head && requestKeepAlive(request);
+
+   request->filename.ptr = request->buf + request->len + 1;
+   request->filename.ptr[0] = '\0';
+   request->filename.len = 0;
+   request->cgiargs.ptr = request->filename.ptr + linelen + 12;
+   request->cgiargs.ptr[0] = '\0';
+   request->cgiargs.len = 0;
+
+   if (request->uri.len == 0) {
+      request->is_static = 1;
+      request->stat_return = -1;
+      return;
+   }
+   request->is_static = requestParseURI(request->uri.ptr, request->filename.ptr, request->cgiargs.ptr);
+   request->uri.len = strlen(request->uri.ptr);
+   request->filename.len = strlen(request->filename.ptr);
+   request->cgiargs.len = strlen(request->cgiargs.ptr);
+   // if the metadata cache does not know the file, it is stat()ed when
+   // queued under a policy that needs its size or age, and otherwise by
+   // the worker, so a FIFO event loop never waits for the file system
+   request->stat_return = statCacheLookup(request->filename.ptr, &request->sbuf);
 }
 
 //
@@ -92,104 +437,743 @@ void requestGetFiletype(char *filename, char *filetype)
       strcpy(filetype, "image/gif");
    else if (strstr(filename, ".jpg")) 
       strcpy(filetype, "image/jpeg");
+   else if (strstr(filename, ".css"))
+      strcpy(filetype, "text/css");
+   else if (strstr(filename, ".json"))
+      strcpy(filetype, "application/json");
+   else if (strstr(filename, ".js"))
+      strcpy(filetype, "application/javascript");
+   else if (strstr(filename, ".svg"))
+      strcpy(filetype, "image/svg+xml");
    else 
       strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(int fd, char *filename, char *cgiargs)
+//
+// Returns 1 if files of this type are text that compresses well
+//
+static int requestCompressible(char *filename)
+{
+   char filetype[MAXLINE];
+
+   requestGetFiletype(filename, filetype);
+   return !strncmp(filetype, "text/", 5) || !strcmp(filetype, "application/json") ||
+          !strcmp(filetype, "application/javascript") || !strcmp(filetype, "image/svg+xml");
+}
+
+void requestServeDynamic(request_t *request)
+{
+   // The CGI program decides how long its body is,
+   // so the connection ends with it.
+   request->keep_alive = 0;
+
+   // the CGI module sends the start of the header once the program runs,
+   // and closes our copy of the socket when it is done, so this worker
+   // does not wait for it
+   if (cgiRun(request->filename.ptr, request->cgiargs.ptr, request->connfd) == 0)
+      request->connfd = -1;
+   else
+      requestError(request, request->filename.ptr, "500", "Internal Server Error", "blg312e Server could not run this CGI program");
+}
+
+
+//
+// Sends the body from *offset up to end with sendfile(2): the file goes
+// from the page cache to the socket without being mapped or copied through
+// user space. Returns -1 if the client is gone or the file shrank, 1 if a
+// non-blocking socket is full.
+//
+static int requestSendfile(request_t *request, int srcfd, off_t *offset, off_t end)
+{
+   ssize_t n;
+
+   while (*offset < end) {
+      if ((n = sendfile(request->connfd, srcfd, offset, end - *offset)) <= 0) {
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+         request->keep_alive = 0;
+         return -1;
+      }
+      request->sent += n;
+      metricsAdd(METRIC_BYTES_SENT, n);
+   }
+   return 0;
+}
+
+//
+// Fills in the validators of the file as header values: an ETag made of
+// its size and modification time, and its Last-Modified date. Every
+// encoding of the file gets an ETag of its own.
+//
+static void requestValidators(struct stat *sbuf, int encoding, char *etag, char *modified)
+{
+   struct tm tm;
+
+   sprintf(etag, "\"%llx-%llx%s%s\"", (long long)sbuf->st_size,
+           (long long)sbuf->st_mtim.tv_sec * 1000000000LL + sbuf->st_mtim.tv_nsec,
+           encoding != ENCODING_IDENTITY ? "-" : "", encoding != ENCODING_IDENTITY ? encoding_names[encoding] : "");
+   gmtime_r(&sbuf->st_mtime, &tm);
+   strftime(modified, VALIDATOR_LEN, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//
+// Returns 1 if what the client accepts decides what it gets for this file
+//
+static int requestVaries(request_t *request, int encoding)
+{
+   return encoding != ENCODING_IDENTITY || requestCompressible(request->filename.ptr);
+}
+
+//
+// Writes the header lines of a static response that only depend on the
+// file and the part of it sent into buf and returns their length; for
+// whole files they are the template kept in the cache entry. The
+// Connection line and the empty line ending the header are added per
+// request. partial makes it a 206 response for bytes start to end - 1
+// of the body in the given encoding.
+//
+static int requestStaticHeader(char *buf, request_t *request, int encoding, int partial, off_t start, off_t end)
+{
+   char filetype[MAXLINE], etag[VALIDATOR_LEN], modified[VALIDATOR_LEN];
+   int len;
+
+   requestGetFiletype(request->filename.ptr, filetype);
+   requestValidators(&request->sbuf, encoding, etag, modified);
+   len = sprintf(buf, "HTTP/1.1 %s\r\n"
+                      "Server: blg312e Web Server\r\n"
+                      "Content-Length: %lld\r\n"
+                      "Content-Type: %s\r\n"
+                      "Accept-Ranges: bytes\r\n"
+                      "ETag: %s\r\n"
+                      "Last-Modified: %s\r\n",
+                 partial ? "206 Partial Content" : "200 OK",
+                 (long long)(end - start), filetype, etag, modified);
+   if (encoding != ENCODING_IDENTITY)
+      len += sprintf(buf + len, "Content-Encoding: %s\r\n", encoding_names[encoding]);
+   if (requestVaries(request, encoding))
+      len += sprintf(buf + len, "Vary: Accept-Encoding\r\n");
+   if (partial)
+      len += sprintf(buf + len, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                     (long long)start, (long long)end - 1, (long long)request->sbuf.st_size);
+   return len;
+}
+
+//
+// Answers with a status that has no body, adding the header lines in lines
+//
+static void requestServeEmpty(request_t *request, char *status, char *lines)
+{
+   response_t response;
+
+   request->status = atoi(status);
+   responseInit(&response);
+   responsePrintf(&response, "HTTP/1.1 %s\r\n"
+                             "Server: blg312e Web Server\r\n"
+                             "%s"
+                             "Connection: %s\r\n\r\n", status, lines, requestConnection(request));
+   responseSend(request, &response, 0);
+}
+
+//
+// Parses an HTTP date (only the preferred "Sun, 06 Nov 1994 08:49:37 GMT"
+// form). Returns -1 if value is not one.
+//
+static time_t requestParseDate(str_t value)
+{
+   char date[64], *end;
+   struct tm tm;
+
+   if (value.len >= sizeof(date))
+      return -1;
+   memcpy(date, value.ptr, value.len);
+   date[value.len] = '\0';
+   memset(&tm, 0, sizeof(tm));
+   end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+   if (end == NULL || *end != '\0')
+      return -1;
+   return timegm(&tm);
+}
+
+//
+// Returns 1 if the If-None-Match list value names etag or is "*".
+// Weak tags match too, as a GET only needs weak comparison.
+//
+static int requestEtagMatch(str_t value, const char *etag)
+{
+   int taglen = strlen(etag);
+   char *p = value.ptr, *end = value.ptr + value.len, *item;
+
+   while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+         p++;
+      item = p;
+      while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+         p++;
+      if (p - item == 1 && *item == '*')
+         return 1;
+      if (p - item > 2 && !strncmp(item, "W/", 2))
+         item += 2;
+      if (p - item == taglen && !strncmp(item, etag, taglen))
+         return 1;
+   }
+   return 0;
+}
+
+//
+// Returns 1 if the client's copy of the file is current: its If-None-Match
+// names the file's ETag or, without If-None-Match, the file has not changed
+// since If-Modified-Since
+//
+static int requestNotModified(request_t *request, char *etag)
+{
+   str_t match = requestHeader(request, "If-None-Match");
+   str_t since;
+   time_t t;
+
+   if (match.ptr)
+      return requestEtagMatch(match, etag);
+   since = requestHeader(request, "If-Modified-Since");
+   return since.ptr && (t = requestParseDate(since)) >= 0 && request->sbuf.st_mtime <= t;
+}
+
+//
+// Answers 304 and returns 1 if the client's copy of the file is current
+//
+static int requestServeNotModified(request_t *request, int encoding, char *etag, char *modified)
 {
-   char buf[MAXLINE], *emptylist[] = {NULL};
+   char buf[MAXLINE];
 
-   // The server does only a little bit of the header.  
-   // The CGI script has to finish writing out the header.
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: blg312e Web Server\r\n", buf);
+   if (!requestNotModified(request, etag))
+      return 0;
+   sprintf(buf, "ETag: %s\r\nLast-Modified: %s\r\n", etag, modified);
+   if (requestVaries(request, encoding))
+      strcat(buf, "Vary: Accept-Encoding\r\n");
+   requestServeEmpty(request, "304 Not Modified", buf);
+   return 1;
+}
 
-   Rio_writen(fd, buf, strlen(buf));
+//
+// Reads the decimal number at *p, before end. Returns 0 if there is none.
+//
+static int requestParseOffset(char **p, char *end, off_t *value)
+{
+   char *s = *p;
 
-   if (Fork() == 0) {
-      /* Child process */
-      Setenv("QUERY_STRING", cgiargs, 1);
-      /* When the CGI process writes to stdout, it will instead go to the socket */
-      Dup2(fd, STDOUT_FILENO);
-      Execve(filename, emptylist, environ);
+   *value = 0;
+   while (s < end && isdigit((unsigned char)*s) && *value < ((off_t)1 << 58))
+      *value = *value * 10 + (*s++ - '0');
+   if (s == *p)
+      return 0;
+   *p = s;
+   return 1;
+}
+
+//
+// Looks at the Range header of the request. Returns 1 and the bytes to
+// send, from *start up to *end, for a single satisfiable range, -1 if the
+// range lies beyond the end of the file and 0 to send the whole file:
+// without a Range header, if If-Range names an older version of the file,
+// for several ranges, or for one we cannot parse.
+//
+static int requestRange(request_t *request, char *etag, char *modified, off_t *start, off_t *end)
+{
+   str_t range = requestHeader(request, "Range");
+   str_t cond = requestHeader(request, "If-Range");
+   off_t size = request->sbuf.st_size, first, last;
+   char *p, *stop;
+
+   if (range.ptr == NULL || range.len < 6 || strncasecmp(range.ptr, "bytes=", 6))
+      return 0;
+   // If-Range holds a strong ETag or the exact Last-Modified date
+   if (cond.ptr && !(cond.len == strlen(etag) && !strncmp(cond.ptr, etag, cond.len)) &&
+       !(cond.len == strlen(modified) && !strncmp(cond.ptr, modified, cond.len)))
+      return 0;
+
+   p = range.ptr + 6;
+   stop = range.ptr + range.len;
+   if (memchr(p, ',', stop - p))
+      return 0;
+   while (p < stop && *p == ' ')
+      p++;
+
+   if (p < stop && *p == '-') {
+      // the last bytes of the file
+      p++;
+      if (!requestParseOffset(&p, stop, &last) || p != stop)
+         return 0;
+      if (last == 0)
+         return -1;
+      *start = last < size ? size - last : 0;
+      *end = size;
+      return 1;
+   }
+
+   if (!requestParseOffset(&p, stop, &first) || p == stop || *p++ != '-')
+      return 0;
+   *end = size;
+   if (p < stop) {
+      if (!requestParseOffset(&p, stop, &last) || p != stop || last < first)
+         return 0;
+      if (last + 1 < size)
+         *end = last + 1;
    }
-   Wait(NULL);
+   if (first >= size)
+      return -1;
+   *start = first;
+   return 1;
 }
 
+static void requestServeFile(request_t *request, char *path, int encoding);
 
-void requestServeStatic(int fd, char *filename, int filesize) 
+//
+// Reads the file at path, size bytes long, into a malloc'd buffer.
+// Returns NULL if it cannot be read as it was when stat'ed.
+//
+static char *requestReadFile(char *path, off_t size)
 {
+   char *body;
    int srcfd;
-   char *srcp, filetype[MAXLINE], buf[MAXBUF];
+   ssize_t n;
+   off_t got = 0;
 
-   requestGetFiletype(filename, filetype);
+   if ((srcfd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return NULL;
+   body = (char*)malloc(size > 0 ? size : 1);
+   while (got < size && (n = read(srcfd, body + got, size - got)) != 0) {
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      got += n;
+   }
+   Close(srcfd);
+   if (got != size) {
+      free(body);
+      return NULL;
+   }
+   return body;
+}
+
+//
+// Reads the file at path, the request's file in the given encoding, into
+// a new cache entry. Returns NULL if the file cannot be read as it was
+// when stat'ed.
+//
+static cache_entry_t *requestCacheLoad(request_t *request, char *path, int encoding)
+{
+   off_t filesize = request->sbuf.st_size;
+   char *header, *body;
+   int headerlen;
+
+   if ((body = requestReadFile(path, filesize)) == NULL)
+      return NULL;
+   header = (char*)malloc(MAXLINE);
+   headerlen = requestStaticHeader(header, request, encoding, 0, 0, filesize);
+   return cachePut(cache_files, path, &request->sbuf, header, headerlen, body, filesize);
+}
+
+//
+// Sends a cached response and releases the entry
+//
+static void requestSendEntry(request_t *request, cache_entry_t *entry)
+{
+   response_t response;
+
+   responseInit(&response);
+   responseAdd(&response, entry->header, entry->headerlen);
+   responsePrintf(&response, "Connection: %s\r\n\r\n", requestConnection(request));
+   responseAdd(&response, entry->body, entry->bodylen);
+   responseSend(request, &response, 0);
+
+   cacheRelease(entry);
+}
 
-   srcfd = Open(filename, O_RDONLY, 0);
+//
+// Serves the file at path from the file cache, loading it into the cache
+// on a miss. Returns 0 if the file is not cacheable.
+//
+static int requestServeCached(request_t *request, char *path, int encoding)
+{
+   cache_entry_t *entry;
+
+   if (!cacheFits(cache_files, request->sbuf.st_size))
+      return 0;
+   if ((entry = cacheGet(cache_files, path, &request->sbuf)) == NULL &&
+       (entry = requestCacheLoad(request, path, encoding)) == NULL)
+      return 0;
+   requestSendEntry(request, entry);
+   return 1;
+}
+
+//
+// Returns 1 if the Accept-Encoding value accepts coding, by name or as
+// "*", with a quality above 0
+//
+static int requestAccepts(str_t accept, const char *coding)
+{
+   int len = strlen(coding), any = 0, acceptable;
+   char *p = accept.ptr, *end = accept.ptr + accept.len, *item, *itemend, *q;
+
+   while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+         p++;
+      item = p;
+      while (p < end && *p != ',')
+         p++;
+      itemend = item;
+      while (itemend < p && *itemend != ';' && *itemend != ' ' && *itemend != '\t')
+         itemend++;
+      // q=0 means not acceptable, any other weight is good enough for us
+      acceptable = 1;
+      for (q = itemend; q + 1 < p; q++) {
+         if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+            acceptable = strtod(q + 2, NULL) > 0;
+            break;
+         }
+      }
+      if (itemend - item == len && !strncasecmp(item, coding, len))
+         return acceptable;
+      if (itemend - item == 1 && *item == '*')
+         any = acceptable;
+   }
+   return any;
+}
+
+//
+// Serves a precompressed sibling of the file, file.gz or file.br, if the
+// client accepts its encoding and it is at least as new as the file.
+// Returns 0 if there is none.
+//
+static int requestServeSibling(request_t *request, str_t accept, int encoding)
+{
+   char path[MAXLINE];
+   struct stat sbuf;
+   int rc;
+
+   if (!requestAccepts(accept, encoding_names[encoding]))
+      return 0;
+   snprintf(path, sizeof(path), "%s%s", request->filename.ptr, encoding_suffixes[encoding]);
+   // most files have no sibling, which the cache remembers too
+   if ((rc = statCacheLookup(path, &sbuf)) == STAT_MISS)
+      rc = statCacheStat(path, &sbuf);
+   if (rc < 0 || !S_ISREG(sbuf.st_mode) || !(S_IRUSR & sbuf.st_mode) ||
+       sbuf.st_mtime < request->sbuf.st_mtime)
+      return 0;
+   // from here on the request is for the sibling, under the file's name
+   request->sbuf = sbuf;
+   requestServeFile(request, path, encoding);
+   return 1;
+}
+
+//
+// Compresses size bytes of data into a malloc'd gzip stream of *len bytes.
+// Returns NULL if zlib fails.
+//
+static char *requestGzip(char *data, off_t size, size_t *len)
+{
+   z_stream z;
+   char *out;
+
+   memset(&z, 0, sizeof(z));
+   // 16 more window bits ask zlib for a gzip header and trailer
+   if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+   out = (char*)malloc(deflateBound(&z, size));
+   z.next_in = (Bytef*)data;
+   z.avail_in = size;
+   z.next_out = (Bytef*)out;
+   z.avail_out = deflateBound(&z, size);
+   if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+      deflateEnd(&z);
+      free(out);
+      return NULL;
+   }
+   *len = z.total_out;
+   deflateEnd(&z);
+   return out;
+}
+
+//
+// Compresses the requested file into a new entry of the compressed cache.
+// Returns NULL if the file cannot be read as it was when stat'ed.
+//
+static cache_entry_t *requestGzipLoad(request_t *request)
+{
+   off_t filesize = request->sbuf.st_size;
+   char *header, *body, *gz;
+   int headerlen;
+   size_t len;
+
+   if ((body = requestReadFile(request->filename.ptr, filesize)) == NULL)
+      return NULL;
+   gz = requestGzip(body, filesize, &len);
+   free(body);
+   if (gz == NULL)
+      return NULL;
+   header = (char*)malloc(MAXLINE);
+   headerlen = requestStaticHeader(header, request, ENCODING_GZIP, 0, 0, len);
+   return cachePut(cache_compressed, request->filename.ptr, &request->sbuf, header, headerlen, gz, len);
+}
+
+//
+// Serves a text file gzip'ed, compressing it on the first request and
+// keeping the result in the compressed cache until the file changes.
+// Returns 0 if the client does not accept gzip, the file is not text, is
+// too small or too large for the cache, or does not get any smaller.
+//
+static int requestServeGzip(request_t *request, str_t accept)
+{
+   cache_entry_t *entry;
+   char etag[VALIDATOR_LEN], modified[VALIDATOR_LEN];
+
+   if (!requestAccepts(accept, "gzip") || !requestCompressible(request->filename.ptr) ||
+       request->sbuf.st_size < GZIP_MIN || !cacheFits(cache_compressed, request->sbuf.st_size))
+      return 0;
+
+   requestValidators(&request->sbuf, ENCODING_GZIP, etag, modified);
+   if (requestServeNotModified(request, ENCODING_GZIP, etag, modified))
+      return 1;
+   if ((entry = cacheGet(cache_compressed, request->filename.ptr, &request->sbuf)) == NULL &&
+       (entry = requestGzipLoad(request)) == NULL)
+      return 0;
+   // the entry stays cached so the file is not compressed again for nothing
+   if (entry->bodylen >= entry->size) {
+      cacheRelease(entry);
+      return 0;
+   }
+   requestSendEntry(request, entry);
+   return 1;
+}
+
+static void requestSetBlocking(request_t *request, int blocking)
+{
+   int flags = Fcntl(request->connfd, F_GETFL, 0);
+
+   Fcntl(request->connfd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+//
+// Answers a request whose file could not be opened or mapped, err being
+// the errno. The file may have gone away or changed since it was stat'ed.
+//
+static void requestFileError(request_t *request, int err)
+{
+   char *filename = request->filename.ptr;
+
+   if (err == ENOENT || err == ENOTDIR)
+      requestError(request, filename, "404", "Not found", "blg312e Server could not find this file");
+   else if (err == EACCES || err == EPERM)
+      requestError(request, filename, "403", "Forbidden", "blg312e Server could not read this file");
+   else
+      requestError(request, filename, "500", "Internal Server Error", "blg312e Server could not read this file");
+}
+
+//
+// Sends the file at path, which holds the requested file in the given
+// encoding and was stat'ed into request->sbuf
+//
+static void requestServeFile(request_t *request, char *path, int encoding)
+{
+   int srcfd, partial, pieces;
+   off_t filesize = request->sbuf.st_size, start = 0, end = filesize;
+   char *srcp, buf[MAXLINE];
+   char etag[VALIDATOR_LEN], modified[VALIDATOR_LEN];
+   response_t response;
+
+   requestValidators(&request->sbuf, encoding, etag, modified);
+   if (requestServeNotModified(request, encoding, etag, modified))
+      return;
+   if ((partial = requestRange(request, etag, modified, &start, &end)) < 0) {
+      sprintf(buf, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n", (long long)filesize);
+      requestServeEmpty(request, "416 Range Not Satisfiable", buf);
+      return;
+   }
+   if (partial)
+      request->status = 206;
+
+   pieces = (static_slice > 0 && end - start > static_slice) ||
+            (static_async_min > 0 && end - start > static_async_min);
+
+   // the cache holds whole responses
+   if (!partial && !pieces && requestServeCached(request, path, encoding))
+      return;
+
+   if ((srcfd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+      requestFileError(request, errno);
+      return;
+   }
+
+   // put together response
+   responseInit(&response);
+   response.len = requestStaticHeader(response.buf, request, encoding, partial, start, end);
+   responseAdd(&response, response.buf, response.len);
+   responsePrintf(&response, "Connection: %s\r\n\r\n", requestConnection(request));
+
+   if (pieces) {
+      // the header now, then as much of the body as the socket takes;
+      // the worker loop comes back for the rest
+      responseSend(request, &response, MSG_MORE);
+      requestSetBlocking(request, 0);
+      request->body_fd = srcfd;
+      request->body_offset = start;
+      request->body_end = end;
+      requestServeSlice(request);
+      return;
+   }
+
+   if (static_mode == STATIC_SENDFILE) {
+      // MSG_MORE holds the header back so it leaves in the same
+      // segment as the start of the body
+      responseSend(request, &response, end > start ? MSG_MORE : 0);
+      requestSendfile(request, srcfd, &start, end);
+      Close(srcfd);
+      return;
+   }
+
+   if (filesize == 0) {
+      Close(srcfd);
+      responseSend(request, &response, 0);
+      return;
+   }
 
    // Rather than call read() to read the file into memory, 
    // which would require that we allocate a buffer, we memory-map the file
-   srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+   srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
    Close(srcfd);
+   if (srcp == MAP_FAILED) {
+      // nothing of the response has left yet
+      requestFileError(request, errno);
+      return;
+   }
 
-   // put together response
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: blg312e Web Server\r\n", buf);
-   sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-   sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
+   //  Writes out the header and the memory-mapped file together
+   responseAdd(&response, srcp + start, end - start);
+   responseSend(request, &response, 0);
+   Munmap(srcp, filesize);
 
-   Rio_writen(fd, buf, strlen(buf));
+}
 
-   //  Writes out to the client socket the memory-mapped file 
-   Rio_writen(fd, srcp, filesize);
-   Munmap(srcp, filesize);
+//
+// Sends the requested file in the best encoding the client accepts:
+// a precompressed sibling if there is one, else gzip'ed on the fly if it
+// is text, else as it is. Ranges always refer to the file as it is.
+//
+void requestServeStatic(request_t *request) 
+{
+   str_t accept = requestHeader(request, "Accept-Encoding");
 
+   if (accept.ptr != NULL && requestHeader(request, "Range").ptr == NULL &&
+       (requestServeSibling(request, accept, ENCODING_BR) ||
+        requestServeSibling(request, accept, ENCODING_GZIP) ||
+        requestServeGzip(request, accept)))
+      return;
+   requestServeFile(request, request->filename.ptr, ENCODING_IDENTITY);
 }
 
-// handle a request
-void requestHandle(int fd, request_t request)
+//
+// Sends more of a body sent in pieces on its non-blocking socket: up to
+// static_slice bytes if set, and no more than the socket takes right now,
+// in which case body_blocked is set. After the last byte, or once the
+// client is gone, the file is closed, the socket blocks again for the
+// next request and the request is logged.
+//
+void requestServeSlice(request_t *request)
 {
+   off_t end = request->body_end;
+   int rc;
 
-   int is_static = request.is_static;
-   struct stat sbuf = request.sbuf;
-   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-   char filename[MAXLINE], cgiargs[MAXLINE];
-   strcpy(buf, request.buf);
-   strcpy(method, request.method);
-   strcpy(uri, request.uri);
-   strcpy(version, request.version);
-   strcpy(filename, request.filename);
-   strcpy(cgiargs, request.cgiargs);
+   if (static_slice > 0 && request->body_offset + static_slice < end)
+      end = request->body_offset + static_slice;
 
-   rio_t rio = request.rio;
+   rc = requestSendfile(request, request->body_fd, &request->body_offset, end);
+   request->body_blocked = rc == 1;
+   if (rc < 0 || request->body_offset == request->body_end) {
+      Close(request->body_fd);
+      request->body_fd = -1;
+      requestSetBlocking(request, 1);
+      logRequest(request, metricsNow() - request->started_at);
+   }
+}
+
+//
+// Serves the server's own statistics instead of a file
+//
+static void requestServeMetrics(request_t *request)
+{
+   response_t response;
+   int len;
+   char *body = metricsRender(&len);
 
-   printf("%s %s %s\n", method, uri, version);
+   responseInit(&response);
+   responsePrintf(&response, "HTTP/1.1 200 OK\r\n"
+                             "Server: blg312e Web Server\r\n"
+                             "Content-Length: %d\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Connection: %s\r\n\r\n", len, requestConnection(request));
+   responseAdd(&response, body, len);
+   responseSend(request, &response, 0);
+   free(body);
+}
+
+//
+// Picks the response for a parsed request
+//
+static void requestRoute(request_t *request)
+{
+   struct stat *sbuf = &request->sbuf;
+   char *filename = request->filename.ptr;
 
-   if (strcasecmp(method, "GET")) {
-      requestError(fd, method, "501", "Not Implemented", "blg312e Server does not implement this method");
+   if (request->bad_head) {
+      requestError(request, "", "431", "Request Header Fields Too Large", "blg312e Server does not take this many header lines");
       return;
    }
-   //requestReadhdrs(&rio);
 
-   is_static = request.is_static;
-   if (request.stat_return < 0) {
-      requestError(fd, filename, "404", "Not found", "blg312e Server could not find this file");
+   if (strcasecmp(request->method.ptr, "GET")) {
+      requestError(request, request->method.ptr, "501", "Not Implemented", "blg312e Server does not implement this method");
       return;
    }
 
-   if (is_static) {
-      if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "blg312e Server could not read this file");
+   if (strcmp(request->uri.ptr, METRICS_URI) == 0) {
+      requestServeMetrics(request);
+      return;
+   }
+
+   if (request->stat_return < 0) {
+      requestError(request, filename, "404", "Not found", "blg312e Server could not find this file");
+      return;
+   }
+
+   if (request->is_static) {
+      if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+         requestError(request, filename, "403", "Forbidden", "blg312e Server could not read this file");
          return;
       }
-      requestServeStatic(fd, filename, sbuf.st_size);
+      requestServeStatic(request);
    } else {
-      if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "blg312e Server could not run this CGI program");
+      if (!(S_ISREG(sbuf->st_mode)) || !(S_IXUSR & sbuf->st_mode)) {
+         requestError(request, filename, "403", "Forbidden", "blg312e Server could not run this CGI program");
          return;
       }
-      requestServeDynamic(fd, filename, cgiargs);
+      requestServeDynamic(request);
    }
 }
 
-
+// handle a request
+void requestHandle(request_t *request)
+{
+   request->started_at = metricsNow();
+   request->status = 200;
+   request->sent = 0;
+   metricsAdd(METRIC_REQUESTS, 1);
+   // another worker, or the prefetcher, may have looked it up meanwhile
+   if (request->stat_return == STAT_MISS &&
+       (request->stat_return = statCacheLookup(request->filename.ptr, &request->sbuf)) == STAT_MISS)
+      request->stat_return = statCacheStat(request->filename.ptr, &request->sbuf);
+   requestRoute(request);
+   // a body sent in slices is logged after its last slice
+   if (request->body_fd < 0)
+      logRequest(request, metricsNow() - request->started_at);
+}
@@ -1,18 +1,100 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
+#include "parse.h"
+
+/* Initial size of a request's buffer; it grows up to MAXBUF */
+#define REQUEST_INITBUF 1024
+
+/* A string inside a request's buffer. method, uri, version, filename and
+   cgiargs are also NUL-terminated, header values are not. */
 typedef struct {
-    int connfd;
+    char *ptr;
+    int len;
+} str_t;
+
+/*
+ * A request and the connection it arrived on. Everything the request
+ * refers to lives in the single buf arena: the raw request head as read
+ * from the socket, followed by the filename and cgiargs derived from it.
+ * Requests are passed around by pointer and never copied.
+ */
+typedef struct request {
+    int connfd;   /* -1 once the CGI module took the connection over */
+    struct in_addr client;
     
     int is_static;
-    int stat_return;
+    int stat_return;   /* of stat(filename), STAT_MISS until it is known */
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    str_t method, uri, version;
+    str_t filename, cgiargs;
+    parse_t parse;   /* where the request line and headers are in buf */
+    int bad_head;    /* more header lines than the parser takes */
+
+    char *buf;   /* arena */
+    int len;     /* bytes read into buf */
+    int cap;     /* size of buf */
+    int headlen; /* length of the current request head at the start of buf */
+
+    /* HTTP/1.1 persistent connections */
+    int keep_alive;   /* keep the connection open after this response */
+    int nrequests;    /* requests read on this connection so far */
+
+    long long queued_at;   /* metricsNow() when it was put into the queue */
+    long long queue_key;   /* the key it was queued with */
+    int prefetch;          /* whether its file is read ahead, see prefetch.c */
+    off_t prefetched;      /* bytes read ahead for it */
+
+    /* a static body sent in pieces, see static_slice and static_async_min */
+    int body_fd;        /* -1 unless some of it is left to send */
+    off_t body_offset;  /* next byte of the file to send */
+    off_t body_end;     /* the body ends before this byte of the file */
+    int body_blocked;   /* the socket was full, wait until it is writable */
+
+    /* the response, for the access log */
+    int status;
+    long long sent;   /* bytes the server wrote itself */
+    long long started_at;
+
+    /* owned by the event loop while waiting for the next request */
+    struct event_loop *loop;   /* the loop that accepted the connection */
+    struct request *prev, *next;
+    time_t idle_since;   /* or, in the middle of a body, since the client last read some */
+    int unsent;          /* bytes in the socket the client had not read when last checked */
 } request_t;
 
-void requestHandle(int fd, request_t request);
+/* Seconds a client turned away with 503 is asked to wait */
+#define REQUEST_RETRY_AFTER 1
+
+/* Most requests served on one connection, 1 disables keep-alive */
+extern int keepalive_max;
+
+/* How requestServeStatic sends file contents */
+enum { STATIC_MMAP, STATIC_SENDFILE };
+extern int static_mode;
+
+/* Static bodies larger than this are sent a slice at a time, with the
+   request going back into the queue between slices; 0 sends them whole */
+extern off_t static_slice;
+
+/* Static bodies larger than this are sent on a non-blocking socket: the
+   worker sends until the socket is full, then the connection waits in the
+   event loop until the client has read some; 0 sends them blocking */
+extern off_t static_async_min;
+
+request_t *requestNew(int connfd);
+int requestGrow(request_t *request);
+void requestFree(request_t *request);
+long requestCount(void);
+void requestReject(request_t *request);
+int requestNext(request_t *request);
+void requestHandle(request_t *request);
+void requestServeStatic(request_t *request);
+void requestServeSlice(request_t *request);
+void requestError(request_t *request, char *cause, char *errnum, char *shortmsg, char *longmsg);
 int requestParseURI(char *uri, char *filename, char *cgiargs);
-void requestReadhdrs(rio_t *rp);
+int requestHeadLength(request_t *request);
+void requestParseHead(request_t *request);
+str_t requestHeader(request_t *request, const char *name);
 
 #endif
@@ -1,5 +1,16 @@
+#define _GNU_SOURCE
 #include "blg312e.h"
 #include "request.h"
+#include "event.h"
+#include "pqueue.h"
+#include "cache.h"
+#include "cgi.h"
+#include "metrics.h"
+#include "log.h"
+#include "parse.h"
+#include "statcache.h"
+#include "prefetch.h"
+#include "affinity.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -7,26 +18,185 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <time.h>
+#include <stdatomic.h>
 
-sem_t empty, fill, mutex;
-int head, tail;
-request_t *queue;
+enum { POLICY_FIFO, POLICY_SFF, POLICY_RFF, POLICY_ASFF, POLICY_SRPT, POLICY_WFQ };
+
+char *policy_names[] = { "FIFO", "SFF", "RFF", "ASFF", "SRPT", "WFQ" };
+#define NPOLICIES (sizeof(policy_names) / sizeof(policy_names[0]))
+
+#define WFQ_FLOWS 65536          // client slots, colliding clients share one
+#define WFQ_REQUEST_COST 1024    // cost of a request on top of its file size
+#define STACK_MIN (128 << 10)    // requestHandle alone needs some 50K
+#define SHED_INTERVAL 100000000  // ns the queue must stay busy before the deadline applies
+
+/*
+ * Weighted fair queueing state: the finish tag of the last request of
+ * every client and the virtual time, which is the tag of the request most
+ * recently taken by a worker (self-clocked fair queueing).
+ */
+typedef struct {
+    in_addr_t addr;
+    long long finish;
+} wfq_flow_t;
+
+/*
+ * Every worker owns a queue ordered by the scheduling policy. The acceptors
+ * fill them round-robin and a worker whose own queue is empty steals from
+ * the others, so workers only contend when they touch the same queue.
+ * Each queue sits on its own cache line. With -g the workers sharing a last
+ * level cache or NUMA node share one queue instead, which the acceptors on
+ * their CPUs fill, so a request is served where it was read.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pqueue_t pq;
+} __attribute__((aligned(64))) worker_queue_t;
+
+sem_t empty;                 // free slots in the buffer
+worker_queue_t *queues;      // one per worker of the minimal pool
+int nqueues;
+int nacceptors = 1;          // event loops, each with its own listening socket
+int pin_threads;             // pin acceptors and workers to CPUs
+int acceptor_cpus[AFFINITY_MAXCPUS];   // acceptor i runs on CPU i % nacceptor_cpus of these
+int nacceptor_cpus;                    // 0 if acceptors are not pinned
+int worker_cpus[AFFINITY_MAXCPUS];     // the same for workers
+int nworker_cpus;
+int group_by = AFFINITY_NONE;   // what the workers sharing a queue share
+int *worker_home;            // the queue of every worker index
+int *acceptor_home;          // with groups, the queue every acceptor fills
+size_t stack_size;           // of the threads serving requests, 0 for the default
+pthread_attr_t thread_attr;  // with that stack size
+__thread int acceptor;       // index of the acceptor running on this thread
+__thread int next_queue;     // its round-robin position
+atomic_int pending;          // requests waiting in all queues
+atomic_int nidle;            // workers sleeping on idle_cond
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+int *listenfds;              // one per acceptor
 int nbuffer;
-int count;
 char *sched_policy;  // Scheduling policy
+int policy;          // sched_policy as one of the POLICY_ constants
+double aging_rate = 1 << 20;   // ASFF: bytes a waiting request's key loses per second
+wfq_flow_t *wfq_flows;
+pthread_mutex_t wfq_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_llong wfq_vtime;
+
+/*
+ * Adaptive pool: workers 0 to min_workers - 1 always run, the others are
+ * started while requests wait longer than grow_after and exit after idling
+ * for shrink_after. Every worker's home is queue worker_home[self].
+ */
+int min_workers, max_workers;     // equal unless -T is given
+long long grow_after = 10000000;  // ns a request may wait before the pool grows
+int shrink_after = 10;            // s a surplus worker may idle
+char *worker_running;             // which worker indices are in use
+int nworkers;                     // workers running, under pool_lock
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_llong wait_max;            // longest queue wait since the pool was last checked
+atomic_int ntaken;                // requests taken since then
+
+/*
+ * Load shedding: with a queue deadline, requests are answered 503 instead
+ * of waiting for a free buffer slot, and so are requests that waited too
+ * long in the queue (see queue_overloaded).
+ */
+long long queue_deadline;         // ns, 0 never sheds
+atomic_llong last_empty;          // when the queues were last found empty
+int listen_backlog = LISTENQ;
 
 /**
- * Prints the elements in the queue along with the head and tail indices.
+ * Prints the connection descriptors in every worker queue in heap order.
  */
 void printQueue() {
-    for(int i = 0; i < nbuffer; i++){
-        printf("%d ", queue[i].connfd);
+    for(int q = 0; q < nqueues; q++){
+        pthread_mutex_lock(&queues[q].lock);
+        printf("queue %d: ", q);
+        for(int i = 0; i < queues[q].pq.size; i++){
+            printf("%d ", queues[q].pq.heap[i].request->connfd);
+        }
+        printf("\n");
+        pthread_mutex_unlock(&queues[q].lock);
+    }
+    printf("pending: %d\n", atomic_load(&pending));
+}
+
+/**
+ * Reads the number of requests waiting in all queues, for the metrics.
+ *
+ * @return long The number of queued requests.
+ */
+long queue_depth() {
+    return atomic_load(&pending);
+}
+
+/**
+ * Reads the number of workers waiting for requests, for the metrics.
+ *
+ * @return long The number of idle workers.
+ */
+long idle_workers() {
+    return atomic_load(&nidle);
+}
+
+/**
+ * Prints how to run the server and exits.
+ *
+ * @param prog The name the server was started with.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options] <port> <threads> <buffers> <sched_policy>\n", prog);
+    fprintf(stderr, "  sched_policy is FIFO, SFF, RFF, ASFF (SFF with aging), SRPT or WFQ (fair per client)\n");
+    fprintf(stderr, "  -A <bytes>    ASFF: size a waiting request gains in priority per second (default 1M)\n");
+    fprintf(stderr, "  -a <threads>  accept connections on this many SO_REUSEPORT sockets (default 1)\n");
+    fprintf(stderr, "  -B <conns>    connections the kernel queues until they are accepted (default 1024)\n");
+    fprintf(stderr, "  -C <conns>    answer 503 to connections beyond this many open ones (default 0, no limit)\n");
+    fprintf(stderr, "  -c <bytes>    cache static files in this much memory, e.g. 64M (default 0, off)\n");
+    fprintf(stderr, "  -D <ms>       answer 503 rather than queue longer than this (default 0, never)\n");
+    fprintf(stderr, "  -E <files>    remember the metadata of this many files, 0 never (default 65536)\n");
+    fprintf(stderr, "  -f <procs>    keep this many processes per CGI program running (default 0)\n");
+    fprintf(stderr, "  -g l3|numa    give the workers sharing a cache or node one queue, implies -p\n");
+    fprintf(stderr, "  -G <ms>       start another worker when requests wait longer than this (default 10)\n");
+    fprintf(stderr, "  -I <seconds>  stop surplus workers idle this long (default 10)\n");
+    fprintf(stderr, "  -k <seconds>  close connections idle this long, 0 disables keep-alive (default 5)\n");
+    fprintf(stderr, "  -l <file>     write the access log to this file (default standard output)\n");
+    fprintf(stderr, "  -L <bytes>    rotate the log file at this size, e.g. 100M (default 0, never)\n");
+    fprintf(stderr, "  -m <requests> most requests served on one connection (default 100)\n");
+    fprintf(stderr, "  -P <bytes>    read the files of queued requests ahead, up to this much (default 0, off)\n");
+    fprintf(stderr, "  -p            pin acceptor i and worker i to CPU i\n");
+    fprintf(stderr, "  -S <bytes>    SRPT: send static files in slices of this size (default 64K)\n");
+    fprintf(stderr, "  -s <mode>     send static files with mmap or sendfile (default mmap)\n");
+    fprintf(stderr, "  -T <threads>  let the pool grow up to this many workers (default <threads>)\n");
+    fprintf(stderr, "  -t <bytes>    stack size of workers and acceptors, at least 128K (default the system's)\n");
+    fprintf(stderr, "  -U <cpus>     pin workers to these CPUs in turn, e.g. 0-7,16-23 (default all with -p)\n");
+    fprintf(stderr, "  -u <cpus>     pin acceptors to these CPUs in turn (default all with -p)\n");
+    fprintf(stderr, "  -v <level>    log nothing (0), errors (1), requests (2) or connections too (3) (default 2)\n");
+    fprintf(stderr, "  -W <seconds>  close connections whose client reads none of a body this long, 0 never (default 60)\n");
+    fprintf(stderr, "  -w <bytes>    send bodies larger than this without blocking a worker, 0 never (default 64K)\n");
+    fprintf(stderr, "  -z <bytes>    keep text files gzip'ed on the fly in this much memory, 0 never (default 16M)\n");
+    exit(1);
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ *
+ * @param s The string to parse.
+ * @return size_t The number of bytes.
+ */
+size_t parse_size(char *s) {
+    char *end;
+    size_t n = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; /* fall through */
+    case 'M': case 'm': n <<= 10; /* fall through */
+    case 'K': case 'k': n <<= 10;
     }
-    printf("head: %d, tail: %d\n", head, tail);
+    return n;
 }
 
 /**
- * Parses command line arguments and assigns values to variables.
+ * Parses command line options and arguments and assigns values to variables.
  *
  * @param port      Pointer to the variable to store the port number.
  * @param nthreads  Pointer to the variable to store the number of threads.
@@ -35,9 +205,175 @@ void printQueue() {
  */
 void getargs(int *port, int *nthreads, int argc, char *argv[])
 {
+    int opt;
+    char *prog = argv[0];
+
+    // the server never blocks a worker on a large body unless told to
+    static_async_min = 64 << 10;
+
+    // options may come before or after the positional arguments
+    while ((opt = getopt(argc, argv, "A:a:B:C:c:D:E:f:G:g:I:k:l:L:m:P:pS:s:T:t:U:u:v:W:w:z:")) != -1) {
+        switch (opt) {
+        case 'A':
+            aging_rate = parse_size(optarg);
+            break;
+        case 'a':
+            if ((nacceptors = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Acceptors must be a positive integer");
+                exit(1);
+            }
+            break;
+        case 'B':
+            if ((listen_backlog = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Backlog must be a positive integer");
+                exit(1);
+            }
+            break;
+        case 'C':
+            if ((max_connections = atoi(optarg)) < 0) {
+                fprintf(stderr, "Connection limit must not be negative");
+                exit(1);
+            }
+            break;
+        case 'c':
+            cache_budget = parse_size(optarg);
+            break;
+        case 'E':
+            if ((statcache_max = atoi(optarg)) < 0) {
+                fprintf(stderr, "Metadata cache size must not be negative");
+                exit(1);
+            }
+            break;
+        case 'D':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Queue deadline must not be negative");
+                exit(1);
+            }
+            queue_deadline = atoi(optarg) * 1000000LL;
+            break;
+        case 'f':
+            if ((cgi_pool_size = atoi(optarg)) < 0) {
+                fprintf(stderr, "CGI pool size must not be negative");
+                exit(1);
+            }
+            break;
+        case 'g':
+            if (strcmp(optarg, "l3") == 0) {
+                group_by = AFFINITY_L3;
+            } else if (strcmp(optarg, "numa") == 0) {
+                group_by = AFFINITY_NUMA;
+            } else {
+                fprintf(stderr, "Groups must be l3 or numa");
+                exit(1);
+            }
+            break;
+        case 'G':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Pool growth threshold must be a positive number of ms");
+                exit(1);
+            }
+            grow_after = atoi(optarg) * 1000000LL;
+            break;
+        case 'I':
+            if ((shrink_after = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Pool idle time must be a positive number of seconds");
+                exit(1);
+            }
+            break;
+        case 'k':
+            if ((keepalive_timeout = atoi(optarg)) < 0) {
+                fprintf(stderr, "Keep-alive timeout must not be negative");
+                exit(1);
+            }
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        case 'L':
+            log_rotate_size = parse_size(optarg);
+            break;
+        case 'm':
+            if ((keepalive_max = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Requests per connection must be a positive integer");
+                exit(1);
+            }
+            break;
+        case 'p':
+            pin_threads = 1;
+            break;
+        case 'P':
+            prefetch_budget = parse_size(optarg);
+            break;
+        case 'S':
+            if ((static_slice = parse_size(optarg)) == 0) {
+                fprintf(stderr, "Slice size must be positive");
+                exit(1);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "mmap") == 0) {
+                static_mode = STATIC_MMAP;
+            } else if (strcmp(optarg, "sendfile") == 0) {
+                static_mode = STATIC_SENDFILE;
+            } else {
+                fprintf(stderr, "Static file mode must be mmap or sendfile");
+                exit(1);
+            }
+            break;
+        case 'T':
+            if ((max_workers = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Maximum threads must be a positive integer");
+                exit(1);
+            }
+            break;
+        case 't':
+            if ((stack_size = parse_size(optarg)) < STACK_MIN) {
+                fprintf(stderr, "Stack size must be at least 128K");
+                exit(1);
+            }
+            break;
+        case 'U':
+            if ((nworker_cpus = affinityParse(optarg, worker_cpus, AFFINITY_MAXCPUS)) < 0) {
+                fprintf(stderr, "Worker CPUs must be a list like 0-3,8");
+                exit(1);
+            }
+            break;
+        case 'u':
+            if ((nacceptor_cpus = affinityParse(optarg, acceptor_cpus, AFFINITY_MAXCPUS)) < 0) {
+                fprintf(stderr, "Acceptor CPUs must be a list like 0-3,8");
+                exit(1);
+            }
+            break;
+        case 'v':
+            log_level = atoi(optarg);
+            if (log_level < LOG_LEVEL_OFF || log_level > LOG_LEVEL_CONNECTIONS) {
+                fprintf(stderr, "Log level must be between 0 and 3");
+                exit(1);
+            }
+            break;
+        case 'W':
+            if ((send_timeout = atoi(optarg)) < 0) {
+                fprintf(stderr, "Send timeout must not be negative");
+                exit(1);
+            }
+            break;
+        case 'w':
+            static_async_min = parse_size(optarg);
+            break;
+        case 'z':
+            cache_compressed_budget = parse_size(optarg);
+            break;
+        default:
+            usage(prog);
+        }
+    }
+    if (keepalive_timeout == 0)
+        keepalive_max = 1;  // every connection serves a single request
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc != 5) {
-        fprintf(stderr, "Usage: %s <port> <threads> <buffers> <sched_policy>\n", argv[0]);
-        exit(1);
+        usage(prog);
     }
     if((*port = atoi(argv[1])) <= 2000) {
       fprintf(stderr, "Port number must be larger than 2000");
@@ -47,187 +383,618 @@ void getargs(int *port, int *nthreads, int argc, char *argv[])
       fprintf(stderr, "Threads must be a positive integer");
       exit(1);
     }
+    min_workers = *nthreads;
+    if (max_workers < min_workers)
+        max_workers = min_workers;
     if((nbuffer = atoi(argv[3])) <= 0){
       fprintf(stderr, "Buffers must be a positive integer");
       exit(1);
     }
-    if(strcmp(argv[4], "FIFO") != 0 && strcmp(argv[4], "SFF") != 0 && strcmp(argv[4], "RFF") != 0){
+    sched_policy = argv[4];
+    for (policy = 0; policy < NPOLICIES; policy++) {
+        if (strcmp(sched_policy, policy_names[policy]) == 0)
+            break;
+    }
+    if (policy == NPOLICIES) {
         fprintf(stderr, "Invalid scheduling policy\n");
-        fprintf(stderr, "Available scheduling policies: FIFO, SFF, RFF");
+        fprintf(stderr, "Available scheduling policies: FIFO, SFF, RFF, ASFF, SRPT, WFQ");
         exit(1);
     }
-    sched_policy = argv[4];
+    if (policy == POLICY_SRPT) {
+        if (static_slice == 0)
+            static_slice = 64 << 10;
+    } else {
+        static_slice = 0;
+    }
+}
+
+/**
+ * Computes the WFQ finish tag of a request: it starts when the client's
+ * previous request finishes, or now in virtual time if that is later, and
+ * takes as long as its cost. All clients have the same weight.
+ *
+ * @param request The request to tag.
+ * @return long long The finish tag.
+ */
+long long wfq_tag(request_t *request) {
+    in_addr_t addr = request->client.s_addr;
+    wfq_flow_t *flow = &wfq_flows[(addr * 2654435761u) % WFQ_FLOWS];
+    long long cost = request->sbuf.st_size + WFQ_REQUEST_COST;
+    long long start;
 
+    pthread_mutex_lock(&wfq_lock);
+    start = atomic_load(&wfq_vtime);
+    if (flow->addr == addr && flow->finish > start)
+        start = flow->finish;
+    flow->addr = addr;
+    flow->finish = start + cost;
+    pthread_mutex_unlock(&wfq_lock);
+    return start + cost;
 }
 
 /**
- * Shifts the elements in the queue to the left starting from the specified index.
- * 
- * @param start_index The index from which to start shifting the elements.
+ * Advances the WFQ virtual time to the tag of a request taken by a worker.
+ *
+ * @param tag The request's finish tag.
+ */
+void wfq_advance(long long tag) {
+    long long vtime = atomic_load(&wfq_vtime);
+
+    while (tag > vtime && !atomic_compare_exchange_weak(&wfq_vtime, &vtime, tag))
+        ;
+}
+
+/**
+ * Computes the key a request is ordered by in the queue, smallest first.
+ * FIFO uses the same key for every request so insertion order decides,
+ * SFF and SRPT use the file size and RFF the negated modification time.
+ * ASFF adds the time the request was queued, scaled by aging_rate, to the
+ * size, so a large file waiting long enough overtakes newer small ones.
+ * WFQ uses the client's finish tag.
+ * Requests whose file could not be found are cheap errors and go first.
+ *
+ * @param request The request to compute the key for, with queued_at set.
+ * @return long long The key of the request.
  */
-void shift_queue_left(int start_index) {
-    // Shift the elements to the left
-    for (int i = start_index; i != (tail - 1 + nbuffer) % nbuffer; i = (i + 1) % nbuffer) {
-        int next_index = (i + 1) % nbuffer;
-        queue[i] = queue[next_index];
+long long queue_key(request_t *request) {
+    if (policy == POLICY_FIFO || request->stat_return < 0)
+        return 0;
+    switch (policy) {
+    case POLICY_SFF:
+    case POLICY_SRPT:
+        return request->sbuf.st_size;
+    case POLICY_ASFF:
+        return request->sbuf.st_size + (long long)(request->queued_at / 1e9 * aging_rate);
+    case POLICY_WFQ:
+        return wfq_tag(request);
+    default:
+        return -(long long)request->sbuf.st_mtime;
     }
-    // make last element empty
-    queue[(tail - 1 + nbuffer) % nbuffer].connfd = -1;
+}
 
-    // Update the head and tail pointers
-    if((tail - 1 + nbuffer) % nbuffer == head)
-    {
-        head = (head + 1) % nbuffer;
+/**
+ * Pins the calling thread to one CPU.
+ *
+ * @param cpu The CPU.
+ */
+void pin_thread(int cpu) {
+    cpu_set_t set;
+    int rc;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+}
+
+/**
+ * Returns the queue of the group the CPU is in, or -1 if no worker of the
+ * minimal pool runs in that group.
+ *
+ * @param cpu The CPU.
+ * @param groups The group of every queue.
+ * @return int Index of the queue.
+ */
+int group_queue(int cpu, int *groups) {
+    int group = affinityGroup(cpu, group_by);
+
+    for (int q = 0; q < nqueues; q++) {
+        if (groups[q] == group)
+            return q;
     }
-    tail = (tail - 1 + nbuffer) % nbuffer;
+    return -1;
 }
 
+/**
+ * Decides where acceptors and workers run and which queue every worker
+ * calls home. With -p or -g the threads without CPUs of their own (-u, -U)
+ * are pinned to the CPUs the server may use. Without groups every worker
+ * of the minimal pool has a queue; with them, every group its workers run
+ * in. A thread in a group without a queue is given one by its index
+ * instead, worker or acceptor i taking queue i % nqueues.
+ *
+ * @param nthreads Workers in the minimal pool.
+ */
+void placement_setup(int nthreads) {
+    int *groups = (int*)malloc(sizeof(int) * nthreads);
+    int q;
+
+    if (pin_threads || group_by != AFFINITY_NONE) {
+        if (nacceptor_cpus == 0)
+            nacceptor_cpus = affinityAllowed(acceptor_cpus, AFFINITY_MAXCPUS);
+        if (nworker_cpus == 0)
+            nworker_cpus = affinityAllowed(worker_cpus, AFFINITY_MAXCPUS);
+    }
+
+    nqueues = nthreads;
+    if (group_by != AFFINITY_NONE) {
+        nqueues = 0;
+        for (int i = 0; i < nthreads; i++) {
+            int cpu = worker_cpus[i % nworker_cpus];
+            if (group_queue(cpu, groups) < 0)
+                groups[nqueues++] = affinityGroup(cpu, group_by);
+        }
+    }
+
+    worker_home = (int*)malloc(sizeof(int) * max_workers);
+    for (int i = 0; i < max_workers; i++) {
+        if (group_by == AFFINITY_NONE ||
+            (q = group_queue(worker_cpus[i % nworker_cpus], groups)) < 0)
+            q = i % nqueues;
+        worker_home[i] = q;
+    }
+    acceptor_home = (int*)malloc(sizeof(int) * nacceptors);
+    for (int i = 0; i < nacceptors; i++) {
+        if (group_by == AFFINITY_NONE ||
+            (q = group_queue(acceptor_cpus[i % nacceptor_cpus], groups)) < 0)
+            q = i % nqueues;
+        acceptor_home[i] = q;
+    }
+    if (group_by != AFFINITY_NONE)
+        logMessage(LOG_LEVEL_CONNECTIONS, "%d workers share %d queues", nthreads, nqueues);
+    free(groups);
+}
+
+/**
+ * Pops the best request of one worker queue.
+ *
+ * @param q Index of the queue.
+ * @return request_t* The request, or NULL if the queue was empty.
+ */
+request_t *queue_pop(int q) {
+    pthread_mutex_lock(&queues[q].lock);
+    request_t *request = pqueuePop(&queues[q].pq);
+    if (request != NULL && atomic_fetch_sub(&pending, 1) == 1 && queue_deadline > 0)
+        atomic_store_explicit(&last_empty, metricsNow(), memory_order_relaxed);
+    pthread_mutex_unlock(&queues[q].lock);
+    return request;
+}
+
+/**
+ * Takes the next request for a worker: from its home queue if possible,
+ * otherwise stolen from the other queues. Sleeps while all queues are empty;
+ * a surplus worker gives up after shrink_after seconds.
+ *
+ * @param self Index of the worker.
+ * @return request_t* The request to handle, or NULL if the worker should exit.
+ */
+request_t *queue_take(int self) {
+    int home = worker_home[self];
+    struct timespec deadline;
+
+    while(1) {
+        request_t *request = queue_pop(home);
+        for (int i = 1; request == NULL && i < nqueues; i++) {
+            request = queue_pop((home + i) % nqueues);
+        }
+        if (request != NULL)
+            return request;
+        if (queue_deadline > 0)
+            atomic_store_explicit(&last_empty, metricsNow(), memory_order_relaxed);
+
+        // nothing to do; pending is checked after announcing ourselves idle
+        // and queue_put checks nidle after raising pending, so no wakeup is lost
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += shrink_after;
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&nidle, 1);
+        while (atomic_load(&pending) == 0) {
+            if (self < min_workers) {
+                pthread_cond_wait(&idle_cond, &idle_lock);
+            } else if (pthread_cond_timedwait(&idle_cond, &idle_lock, &deadline) == ETIMEDOUT &&
+                       atomic_load(&pending) == 0) {
+                atomic_fetch_sub(&nidle, 1);
+                pthread_mutex_unlock(&idle_lock);
+                return NULL;
+            }
+        }
+        atomic_fetch_sub(&nidle, 1);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/**
+ * Puts a request whose body is being sent in pieces back into a queue.
+ * Size based policies order it by the bytes it has left, the others keep
+ * its original key. It already holds no buffer slot, so this never waits.
+ *
+ * @param q Index of the queue.
+ * @param request The request.
+ */
+void queue_continue(int q, request_t *request) {
+    long long key = request->queue_key;
+
+    if (policy == POLICY_SFF || policy == POLICY_SRPT || policy == POLICY_ASFF)
+        key -= request->sbuf.st_size - (request->body_end - request->body_offset);
+
+    request->queued_at = metricsNow();
+    pthread_mutex_lock(&queues[q].lock);
+    pqueuePush(&queues[q].pq, key, request);
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_unlock(&queues[q].lock);
+
+    if (atomic_load(&nidle) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/**
+ * Notes for the pool manager that a worker took a request.
+ *
+ * @param wait How long the request waited in the queue, in ns.
+ */
+void pool_taken(long long wait) {
+    long long max = atomic_load_explicit(&wait_max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&ntaken, 1, memory_order_relaxed);
+    while (wait > max && !atomic_compare_exchange_weak(&wait_max, &max, wait))
+        ;
+}
+
+void* thread_handle(void* arg);
+
+/**
+ * Starts a worker with the lowest free index, if the pool is not full.
+ *
+ * @return int The number of workers now running, 0 if none was started.
+ */
+int pool_grow() {
+    pthread_t tid;
+    int i, n;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < max_workers && worker_running[i]; i++)
+        ;
+    if (i == max_workers) {
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+    worker_running[i] = 1;
+    n = ++nworkers;
+    pthread_mutex_unlock(&pool_lock);
+
+    metricsWorkers(1);
+    pthread_create(&tid, &thread_attr, thread_handle, (void*)(long)i);
+    pthread_detach(tid);
+    return n;
+}
+
+/**
+ * Gives up the index, metrics slot and log ring of a surplus worker that
+ * is about to exit.
+ *
+ * @param self Index of the worker.
+ */
+void pool_exit(int self) {
+    int n;
+
+    pthread_mutex_lock(&pool_lock);
+    worker_running[self] = 0;
+    n = --nworkers;
+    pthread_mutex_unlock(&pool_lock);
+    metricsWorkers(-1);
+    metricsAdd(METRIC_POOL_SHRUNK, 1);
+    logMessage(LOG_LEVEL_CONNECTIONS, "worker %d idle for %ds, %d left", self, shrink_after, n);
+    // the next worker started takes these over
+    metricsRelease();
+    logRelease();
+}
+
+/**
+ * Grows the pool while requests wait too long: every grow_after it starts
+ * a worker if requests are queued, no worker is idle, and the longest wait
+ * since the last check exceeded grow_after or no request was taken at all,
+ * as happens when every worker is stuck on slow clients or disks.
+ *
+ * @param arg Unused.
+ * @return void* Never returns.
+ */
+void* pool_manager(void* arg) {
+    struct timespec tick = { grow_after / 1000000000, grow_after % 1000000000 };
+
+    while (1) {
+        nanosleep(&tick, NULL);
+        long long wait = atomic_exchange(&wait_max, 0);
+        int taken = atomic_exchange(&ntaken, 0), n;
+
+        if (atomic_load(&pending) > 0 && atomic_load(&nidle) == 0 &&
+            (wait > grow_after || taken == 0) && (n = pool_grow()) > 0) {
+            metricsAdd(METRIC_POOL_GROWN, 1);
+            logMessage(LOG_LEVEL_CONNECTIONS, "requests waited %lld ms, %d workers",
+                       (taken == 0 ? grow_after : wait) / 1000000, n);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Decides whether a request taken from the queue is shed, in the manner of
+ * CoDel as used for server queues: a queue that has not been empty for
+ * SHED_INTERVAL is a standing queue, not a burst, and then requests that
+ * waited longer than queue_deadline are shed. Otherwise only those that
+ * waited longer than SHED_INTERVAL are, so a burst is still served.
+ *
+ * @param wait How long the request waited, in ns.
+ * @param now The current time, in ns.
+ * @return int 1 if it should be answered 503.
+ */
+int queue_overloaded(long long wait, long long now) {
+    long long limit = queue_deadline;
+
+    if (now - atomic_load_explicit(&last_empty, memory_order_relaxed) < SHED_INTERVAL &&
+        limit < SHED_INTERVAL)
+        limit = SHED_INTERVAL;
+    return wait > limit;
+}
+
+/**
+ * Answers a request 503 instead of serving it and closes its connection.
+ *
+ * @param request The request to turn away.
+ */
+void shed(request_t *request) {
+    request->started_at = metricsNow();
+    request->sent = 0;
+    requestReject(request);
+    metricsAdd(METRIC_SHED, 1);
+    logRequest(request, metricsNow() - request->started_at);
+    Close(request->connfd);
+    requestFree(request);
+}
 
 /**
  * @brief This function is the entry point for a thread that handles incoming requests.
  * 
- * @param port The port number on which the server is listening.
+ * @param arg Index of the worker, cast to a pointer.
  * @return void* Returns NULL.
  */
-void* thread_handle(void* port) {
+void* thread_handle(void* arg) {
+    int self = (int)(long)arg;
+
+    if (nworker_cpus > 0)
+        pin_thread(worker_cpus[self % nworker_cpus]);
+
     while(1) {
-        // wait for a request to be put into the queue
-        sem_wait(&fill);
-        sem_wait(&mutex);
-
-        // find the target index depending on the scheduling policy
-        int target = -1;
-        if (strcmp(sched_policy, "FIFO") == 0) {
-            target = head;
-        } else if (strcmp(sched_policy, "RFF") == 0) {
-            time_t latest = -1;
-            // find the latest modified file
-            for (int i = 0; i < nbuffer; i++) {
-                if (queue[i].connfd != -1 && queue[i].sbuf.st_mtime > latest) {
-                    latest = queue[i].sbuf.st_mtime;
-                    //printf("latest: %ld\n",  ((queue[i].sbuf.st_mtime)));
-                    target = i;
-                }
-            }
-        } else if (strcmp(sched_policy, "SFF") == 0) {
-            off_t smallest = LONG_MAX;
-            // find the smallest file
-            for (int i = 0; i < nbuffer; i++) {
-                if (queue[i].connfd != -1 && queue[i].sbuf.st_size < smallest) {
-                    smallest = queue[i].sbuf.st_size;
-                    target = i;
-                }
-            }
+        // take the next request according to the scheduling policy
+        request_t *request = queue_take(self);
+        if (request == NULL) {
+            pool_exit(self);
+            return NULL;
         }
+        long long start = metricsNow();
 
-        // get the connection file descriptor
-        int connfd = queue[target].connfd;
-        // copy the request to a local variable
-        request_t request;
-        request.connfd = connfd;
-        request.is_static = queue[target].is_static;
-        request.stat_return = queue[target].stat_return;
-        request.sbuf = queue[target].sbuf;
-        strcpy(request.buf, queue[target].buf);
-        strcpy(request.method, queue[target].method);
-        strcpy(request.uri, queue[target].uri);
-        strcpy(request.version, queue[target].version);
-        strcpy(request.filename, queue[target].filename);
-        strcpy(request.cgiargs, queue[target].cgiargs);
-        request.rio = queue[target].rio;
-        
-        // make the slot empty in the queue
-        queue[target].connfd = -1;
-
-        // update the head if necessary
-        if (target == head) {
-            head = (head + 1) % nbuffer;
-        } else { 
-            // shift the elements after the target to the left if target is not head
-            shift_queue_left(target);
+        prefetchDone(request);
+        metricsObserve(METRIC_QUEUE_WAIT, start - request->queued_at);
+        if (max_workers > min_workers)
+            pool_taken(start - request->queued_at);
+        if (policy == POLICY_WFQ)
+            wfq_advance(request->queue_key);
+
+        // signal the empty semaphore, unless this is a body sent in pieces
+        // which gave its slot back when it was first taken
+        if (request->body_fd < 0)
+            sem_post(&empty);
+
+        if (request->body_fd < 0 && queue_deadline > 0 &&
+            queue_overloaded(start - request->queued_at, start)) {
+            shed(request);
+            continue;
         }
-        // update the count
-        count--;
-        
-        // signal the empty semaphore
-        sem_post(&mutex);
-        sem_post(&empty);
 
-        requestHandle(connfd, request); // handle the request
-        Close(connfd); // close the connection file descriptor
+        while (1) {
+            if (request->body_fd >= 0)
+                requestServeSlice(request);
+            else
+                requestHandle(request); // handle the request
+
+            long long end = metricsNow();
+            metricsObserve(METRIC_SERVICE, end - start);
+            metricsAdd(METRIC_BUSY_NS, end - start);
+            start = end;
+
+            if (request->body_fd >= 0) {
+                if (request->body_blocked)
+                    eventResume(request);   // the event loop brings it back once writable
+                else
+                    queue_continue(worker_home[self], request);   // the next slice, after smaller requests
+                break;
+            }
+
+            if (!request->keep_alive) {
+                if (request->connfd >= 0)
+                    Close(request->connfd); // close the connection file descriptor
+                requestFree(request);
+                break;
+            }
+            if (!requestNext(request)) {
+                // wait for the next request in the event loop, not on this thread
+                eventResume(request);
+                break;
+            }
+            // a pipelined request already arrived, answer it in order
+            requestParseHead(request);
+        }
+    }
+}
+
+/**
+ * Picks the queue for the next request of the calling acceptor. Acceptor
+ * a fills the queues of workers a, a + nacceptors, a + 2 * nacceptors, ...
+ * in turn, so acceptors do not share a round-robin position and, when
+ * threads are pinned, requests start out on the CPU that accepted them.
+ * With groups every acceptor fills the queue of its own group.
+ *
+ * @return int Index of the queue.
+ */
+int queue_next() {
+    int q;
+
+    if (group_by != AFFINITY_NONE)
+        return acceptor_home[acceptor];
+    if (nqueues <= nacceptors)
+        return acceptor % nqueues;
+    q = acceptor + next_queue * nacceptors;
+    if (q >= nqueues) {
+        next_queue = 0;
+        q = acceptor;
     }
+    next_queue++;
+    return q;
 }
 
 /**
- * Puts a connection file descriptor into the queue.
- * Also reads the request line and headers from the connection file descriptor.
+ * Puts a parsed request into the next worker queue of this acceptor
+ * and wakes an idle worker, which takes it or steals it.
+ * Called by an event loop once the request line and headers have been read,
+ * so no socket I/O happens while a queue is locked.
  * 
- * @param connfd The connection file descriptor to be put into the queue.
+ * @param request The request to be put into the queue.
  */
-void queue_put(int connfd) {
+void queue_put(request_t *request) {
+    long long key;
+    int q = queue_next();
+
+    if (request->body_fd >= 0) {
+        // the client made room for more of its response
+        queue_continue(q, request);
+        return;
+    }
 
-    sem_wait(&empty);
-    sem_wait(&mutex);
+    // with a deadline a full buffer means overload, and waiting for a
+    // slot here would stall every connection of this event loop
+    if (queue_deadline > 0 && sem_trywait(&empty) < 0) {
+        shed(request);
+        return;
+    }
+
+    // the policies that order by size or age need the file's metadata
+    // even when the cache does not know it yet; no lock is held here
+    if (policy != POLICY_FIFO && request->stat_return == STAT_MISS)
+        request->stat_return = statCacheStat(request->filename.ptr, &request->sbuf);
+
+    request->queued_at = metricsNow();
+    request->queue_key = key = queue_key(request);
 
-    // initialize rio
-    Rio_readinitb(&(queue[tail].rio), connfd);
-    Rio_readlineb(&(queue[tail].rio), queue[tail].buf, MAXLINE);
-    // read method, uri, version
-    sscanf(queue[tail].buf, "%s %s %s", queue[tail].method, queue[tail].uri, queue[tail].version);
+    if (queue_deadline == 0)
+        sem_wait(&empty);
+    prefetchAdd(request);
 
-    // parse uri
-    queue[tail].is_static = requestParseURI(queue[tail].uri, queue[tail].filename, queue[tail].cgiargs);
-    // get file stats
-    queue[tail].stat_return = stat(queue[tail].filename, &(queue[tail].sbuf));
-    // read headers
-    requestReadhdrs(&(queue[tail].rio));
+    pthread_mutex_lock(&queues[q].lock);
+    pqueuePush(&queues[q].pq, key, request);
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_unlock(&queues[q].lock);
 
-    // update connfd
-    queue[tail].connfd = connfd;
-    // update queue
-    tail = (tail + 1) % nbuffer;
-    count++;
+    if (atomic_load(&nidle) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
 
-    sem_post(&mutex);
-    sem_post(&fill);
+/**
+ * Runs the event loop of one acceptor on its listening socket.
+ *
+ * @param arg Index of the acceptor, cast to a pointer.
+ * @return void* Never returns.
+ */
+void* acceptor_handle(void* arg) {
+    acceptor = (int)(long)arg;
+    if (nacceptor_cpus > 0)
+        pin_thread(acceptor_cpus[acceptor % nacceptor_cpus]);
+    eventLoop(listenfds[acceptor], queue_put);
+    return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-    int listenfd, port, clientlen, nthreads, connfd;
-    struct sockaddr_in clientaddr;
+    int port, nthreads;
     getargs(&port, &nthreads, argc, argv);
-    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
-    count = 0;
-    head = 0;
-    tail = 0;
-    queue = (request_t*)malloc(sizeof(request_t) * nbuffer);
-    for (int i = 0; i < nbuffer; i++) {
-        queue[i].connfd = -1;  // Initialize empty slots
+    // clients closing early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    logInit();
+    parseSetup();
+    statCacheInit();
+    prefetchInit();
+    metricsInit(sched_policy);
+    atomic_store(&last_empty, metricsNow());
+    metricsGauge("blg312e_queue_depth", "Requests waiting for a worker.", queue_depth);
+    metricsGauge("blg312e_idle_workers", "Workers waiting for requests.", idle_workers);
+    metricsGauge("blg312e_open_connections", "Connections the server holds, in the event loops or the workers.", requestCount);
+    cacheInit();
+    cgiInit();
+    if (policy == POLICY_WFQ)
+        wfq_flows = (wfq_flow_t*)calloc(WFQ_FLOWS, sizeof(wfq_flow_t));
+    placement_setup(nthreads);
+    queues = (worker_queue_t*)aligned_alloc(sizeof(worker_queue_t), sizeof(worker_queue_t) * nqueues);
+    for (int i = 0; i < nqueues; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        pqueueInit(&queues[i].pq, nbuffer / nqueues + 1);
+    }
+    // with several acceptors every one listens on its own socket and the
+    // kernel balances connections over them
+    listenfds = (int*)malloc(sizeof(int) * nacceptors);
+    for (int i = 0; i < nacceptors; i++) {
+        listenfds[i] = Open_listenfd_opts(port, nacceptors > 1, listen_backlog);
     }
-    listenfd = Open_listenfd(port);
 
-    sem_init(&mutex, 0, 1);  // semaphore for mutual exclusion
     sem_init(&empty, 0, nbuffer);  // semaphore for empty slots
-    sem_init(&fill, 0, 0);  // semaphore for filled slots
 
-    // create thread pool for handling requests
+    // workers and acceptors get the stack size asked for, acceptor 0 keeps
+    // the main thread's
+    pthread_attr_init(&thread_attr);
+    if (stack_size > 0 && (errno = pthread_attr_setstacksize(&thread_attr, stack_size)) != 0)
+        unix_error("pthread_attr_setstacksize error");
+
+    // create thread pool for handling requests, and the thread growing it
+    worker_running = (char*)calloc(max_workers, 1);
     for(int i = 0; i < nthreads; i++){
-        pthread_create(&tids[i], NULL, thread_handle, NULL);
+        pool_grow();
+    }
+    if (max_workers > min_workers) {
+        pthread_t tid;
+        pthread_create(&tid, &thread_attr, pool_manager, NULL);
     }
 
-    // start listening the port
-    while (1) {    
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen);
-        printf("Client %d\n", connfd);
-        queue_put(connfd);
+    // accept connections and read their requests until the server is killed,
+    // acceptor 0 runs on the main thread
+    for (int i = 1; i < nacceptors; i++) {
+        pthread_t tid;
+        pthread_create(&tid, &thread_attr, acceptor_handle, (void*)(long)i);
     }
+    acceptor_handle((void*)0);
 
     // cleanup
-    sem_destroy(&mutex);
     sem_destroy(&empty);
-    sem_destroy(&fill);
-    free(queue);
-    free(tids);
+    for (int i = 0; i < nqueues; i++) {
+        pthread_mutex_destroy(&queues[i].lock);
+        pqueueDestroy(&queues[i].pq);
+    }
+    pthread_attr_destroy(&thread_attr);
+    free(queues);
+    free(listenfds);
+    free(worker_running);
+    free(worker_home);
+    free(acceptor_home);
 }
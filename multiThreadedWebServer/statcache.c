@@ -0,0 +1,440 @@
+//
+// statcache.c: Remembers what stat() said about the files being served.
+//
+// Every directory under the current one is watched with inotify, and a
+// thread of its own drops the entries of whatever changes there, so a hit
+// costs no system call. Files that do not exist are remembered as well,
+// which answers repeated 404s. Only plain paths ("./a/b", without empty,
+// "." or ".." components) in a watched directory are cached; symbolic
+// links, and files in directories that could not be watched, are stat'ed
+// every time. The cache is behind a change by as long as the thread takes
+// to see it.
+//
+
+#include "blg312e.h"
+#include "statcache.h"
+#include "metrics.h"
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <stdatomic.h>
+
+#define STATCACHE_SHARDS 16
+#define STATCACHE_BUCKETS 1024   /* hash buckets per shard */
+#define WATCH_BUCKETS 256
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                      IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_ONLYDIR | IN_DONT_FOLLOW)
+
+typedef struct stat_entry {
+   char *path;
+   int rc;             // 0, or -1 if the file does not exist
+   struct stat sbuf;
+   struct stat_entry *next;
+} stat_entry_t;
+
+typedef struct {
+   pthread_rwlock_t lock;
+   stat_entry_t *buckets[STATCACHE_BUCKETS];
+   int count;
+} __attribute__((aligned(64))) stat_shard_t;
+
+// a watched directory
+typedef struct watch {
+   int wd;
+   char *path;
+   struct watch *next;
+} watch_t;
+
+int statcache_max = 65536;
+
+static stat_shard_t *shards;   // NULL while the cache is off
+
+// bumped by every change seen, so a stat() that raced with one is not kept
+static atomic_uint generation;
+
+// the watched directories by path, and by watch descriptor for the events
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static watch_t *watch_buckets[WATCH_BUCKETS];
+static watch_t **watch_wds;
+static int watch_nwds;
+static int notify_fd = -1;
+
+// FNV-1a
+static unsigned int statCacheHash(const char *key, int len)
+{
+   unsigned int h = 2166136261u;
+
+   for (int i = 0; i < len; i++) {
+      h ^= (unsigned char)key[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static void statCacheFlush(void)
+{
+   stat_entry_t *entry, *next;
+
+   atomic_fetch_add(&generation, 1);
+   for (int i = 0; i < STATCACHE_SHARDS; i++) {
+      pthread_rwlock_wrlock(&shards[i].lock);
+      for (int b = 0; b < STATCACHE_BUCKETS; b++) {
+         for (entry = shards[i].buckets[b]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->path);
+            free(entry);
+         }
+         shards[i].buckets[b] = NULL;
+      }
+      shards[i].count = 0;
+      pthread_rwlock_unlock(&shards[i].lock);
+   }
+}
+
+static void statCacheDrop(const char *path)
+{
+   unsigned int h = statCacheHash(path, strlen(path));
+   stat_shard_t *shard = &shards[h % STATCACHE_SHARDS];
+   stat_entry_t **p, *entry;
+
+   atomic_fetch_add(&generation, 1);
+   pthread_rwlock_wrlock(&shard->lock);
+   for (p = &shard->buckets[(h / STATCACHE_SHARDS) % STATCACHE_BUCKETS]; *p != NULL; p = &(*p)->next) {
+      if (!strcmp((*p)->path, path)) {
+         entry = *p;
+         *p = entry->next;
+         shard->count--;
+         free(entry->path);
+         free(entry);
+         break;
+      }
+   }
+   pthread_rwlock_unlock(&shard->lock);
+}
+
+//
+// Returns 1 if path is a plain path under the current directory
+//
+static int statCacheable(const char *path)
+{
+   const char *p;
+
+   if (strncmp(path, "./", 2) != 0)
+      return 0;
+   for (p = path + 1; *p != '\0'; p++) {
+      // p is at a '/', check the component after it
+      if (*p != '/')
+         continue;
+      if (p[1] == '/' || p[1] == '\0')
+         return 0;
+      if (p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+         return 0;
+      if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || p[3] == '\0'))
+         return 0;
+   }
+   return 1;
+}
+
+//
+// Returns 1 if the directory path is in is watched
+//
+static int statCacheWatched(const char *path)
+{
+   int len = strrchr(path, '/') - path;
+   watch_t *watch;
+
+   pthread_mutex_lock(&watch_lock);
+   for (watch = watch_buckets[statCacheHash(path, len) % WATCH_BUCKETS]; watch != NULL; watch = watch->next) {
+      if ((int)strlen(watch->path) == len && !strncmp(watch->path, path, len))
+         break;
+   }
+   pthread_mutex_unlock(&watch_lock);
+   return watch != NULL;
+}
+
+static void statCacheAddWatch(int wd, const char *path)
+{
+   watch_t *watch = (watch_t*)malloc(sizeof(watch_t));
+   unsigned int b = statCacheHash(path, strlen(path)) % WATCH_BUCKETS;
+
+   watch->wd = wd;
+   watch->path = strdup(path);
+   pthread_mutex_lock(&watch_lock);
+   if (wd >= watch_nwds) {
+      watch_wds = (watch_t**)realloc(watch_wds, (wd + 64) * sizeof(watch_t*));
+      memset(watch_wds + watch_nwds, 0, (wd + 64 - watch_nwds) * sizeof(watch_t*));
+      watch_nwds = wd + 64;
+   }
+   // already watched, under the path it was first found at
+   if (watch_wds[wd] != NULL) {
+      pthread_mutex_unlock(&watch_lock);
+      free(watch->path);
+      free(watch);
+      return;
+   }
+   watch_wds[wd] = watch;
+   watch->next = watch_buckets[b];
+   watch_buckets[b] = watch;
+   pthread_mutex_unlock(&watch_lock);
+}
+
+static void statCacheRemoveWatch(int wd)
+{
+   watch_t **p, *watch;
+
+   pthread_mutex_lock(&watch_lock);
+   if (wd < 0 || wd >= watch_nwds || (watch = watch_wds[wd]) == NULL) {
+      pthread_mutex_unlock(&watch_lock);
+      return;
+   }
+   watch_wds[wd] = NULL;
+   p = &watch_buckets[statCacheHash(watch->path, strlen(watch->path)) % WATCH_BUCKETS];
+   while (*p != watch)
+      p = &(*p)->next;
+   *p = watch->next;
+   pthread_mutex_unlock(&watch_lock);
+   free(watch->path);
+   free(watch);
+}
+
+//
+// Watches dir and every directory below it that is not a symbolic link
+//
+static void statCacheWalk(const char *dir)
+{
+   char path[MAXLINE];
+   struct dirent *d;
+   struct stat sbuf;
+   DIR *dp;
+   int wd;
+
+   if ((wd = inotify_add_watch(notify_fd, dir, WATCH_EVENTS)) < 0) {
+      if (errno == ENOSPC)
+         fprintf(stderr, "inotify watch limit reached, files under %s are not cached\n", dir);
+      return;
+   }
+   statCacheAddWatch(wd, dir);
+   if ((dp = opendir(dir)) == NULL)
+      return;
+   while ((d = readdir(dp)) != NULL) {
+      if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+         continue;
+      if (snprintf(path, sizeof(path), "%s/%s", dir, d->d_name) >= (int)sizeof(path))
+         continue;
+      if (d->d_type == DT_DIR ||
+          (d->d_type == DT_UNKNOWN && lstat(path, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)))
+         statCacheWalk(path);
+   }
+   closedir(dp);
+}
+
+//
+// Starts watching from scratch, after a directory was moved and the paths
+// of the watches below it are no longer right
+//
+static void statCacheRewatch(void)
+{
+   int old = notify_fd;
+
+   pthread_mutex_lock(&watch_lock);
+   for (int b = 0; b < WATCH_BUCKETS; b++) {
+      watch_t *watch, *next;
+
+      for (watch = watch_buckets[b]; watch != NULL; watch = next) {
+         next = watch->next;
+         free(watch->path);
+         free(watch);
+      }
+      watch_buckets[b] = NULL;
+   }
+   memset(watch_wds, 0, watch_nwds * sizeof(watch_t*));
+   if ((notify_fd = inotify_init1(IN_CLOEXEC)) < 0)
+      unix_error("inotify_init1 error");
+   pthread_mutex_unlock(&watch_lock);
+   Close(old);
+
+   statCacheFlush();
+   statCacheWalk(".");
+   // changes made while the new watches were being set up went unseen
+   statCacheFlush();
+}
+
+//
+// Handles one event. Returns 1 if the watches were set up again, which
+// makes the rest of the events read with it meaningless.
+//
+static int statCacheEvent(struct inotify_event *event)
+{
+   char path[MAXLINE];
+   int wd = event->wd, found = 0;
+
+   if (event->mask & IN_Q_OVERFLOW) {
+      statCacheFlush();
+      return 0;
+   }
+   if ((event->mask & IN_MOVE_SELF) ||
+       ((event->mask & IN_ISDIR) && (event->mask & (IN_MOVED_FROM | IN_MOVED_TO)))) {
+      statCacheRewatch();
+      return 1;
+   }
+   if (event->mask & IN_IGNORED) {
+      // the directory is gone, and with it whatever was under it
+      statCacheRemoveWatch(wd);
+      statCacheFlush();
+      return 0;
+   }
+   if (event->len == 0)
+      return 0;
+
+   pthread_mutex_lock(&watch_lock);
+   if (wd >= 0 && wd < watch_nwds && watch_wds[wd] != NULL)
+      found = snprintf(path, sizeof(path), "%s/%s", watch_wds[wd]->path, event->name) < (int)sizeof(path);
+   pthread_mutex_unlock(&watch_lock);
+   if (!found)
+      return 0;
+   statCacheDrop(path);
+   if ((event->mask & IN_ISDIR) && (event->mask & IN_CREATE))
+      statCacheWalk(path);
+   return 0;
+}
+
+static void *statCacheThread(void *arg)
+{
+   char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+   struct inotify_event *event;
+   ssize_t n;
+   char *p;
+
+   while (1) {
+      if ((n = read(notify_fd, buf, sizeof(buf))) < 0) {
+         if (errno == EINTR)
+            continue;
+         unix_error("inotify read error");
+      }
+      for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len) {
+         event = (struct inotify_event*)p;
+         if (statCacheEvent(event))
+            break;
+      }
+   }
+   return NULL;
+}
+
+//
+// Watches the current directory and starts the thread that follows the
+// changes. The cache stays off if statcache_max is 0 or inotify is not
+// available.
+//
+void statCacheInit(void)
+{
+   pthread_t tid;
+
+   if (statcache_max <= 0)
+      return;
+   if ((notify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+      fprintf(stderr, "inotify unavailable (%s), file metadata is not cached\n", strerror(errno));
+      return;
+   }
+   shards = (stat_shard_t*)aligned_alloc(64, STATCACHE_SHARDS * sizeof(stat_shard_t));
+   memset(shards, 0, STATCACHE_SHARDS * sizeof(stat_shard_t));
+   for (int i = 0; i < STATCACHE_SHARDS; i++)
+      pthread_rwlock_init(&shards[i].lock, NULL);
+   statCacheWalk(".");
+   pthread_create(&tid, NULL, statCacheThread, NULL);
+   pthread_detach(tid);
+}
+
+//
+// Answers stat(path, sbuf) from the cache: 0, or -1 if path does not
+// exist. Returns STAT_MISS if the cache does not know, in which case
+// statCacheStat has to be called.
+//
+int statCacheLookup(const char *path, struct stat *sbuf)
+{
+   unsigned int h;
+   stat_shard_t *shard;
+   stat_entry_t *entry;
+   int rc = STAT_MISS;
+
+   if (shards == NULL)
+      return STAT_MISS;
+   h = statCacheHash(path, strlen(path));
+   shard = &shards[h % STATCACHE_SHARDS];
+   pthread_rwlock_rdlock(&shard->lock);
+   for (entry = shard->buckets[(h / STATCACHE_SHARDS) % STATCACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+      if (!strcmp(entry->path, path)) {
+         rc = entry->rc;
+         if (rc == 0)
+            *sbuf = entry->sbuf;
+         break;
+      }
+   }
+   pthread_rwlock_unlock(&shard->lock);
+   if (rc != STAT_MISS)
+      metricsAdd(METRIC_STAT_HITS, 1);
+   return rc;
+}
+
+static void statCachePut(const char *path, int rc, struct stat *sbuf, unsigned int seen)
+{
+   unsigned int h = statCacheHash(path, strlen(path));
+   stat_shard_t *shard = &shards[h % STATCACHE_SHARDS];
+   stat_entry_t **bucket = &shard->buckets[(h / STATCACHE_SHARDS) % STATCACHE_BUCKETS];
+   stat_entry_t *entry, *next;
+
+   pthread_rwlock_wrlock(&shard->lock);
+   if (atomic_load(&generation) != seen) {
+      pthread_rwlock_unlock(&shard->lock);
+      return;
+   }
+   for (entry = *bucket; entry != NULL && strcmp(entry->path, path); entry = entry->next)
+      ;
+   if (entry == NULL) {
+      // a full shard starts over rather than keep track of what is used
+      if (shard->count >= statcache_max / STATCACHE_SHARDS + 1) {
+         for (int b = 0; b < STATCACHE_BUCKETS; b++) {
+            for (entry = shard->buckets[b]; entry != NULL; entry = next) {
+               next = entry->next;
+               free(entry->path);
+               free(entry);
+            }
+            shard->buckets[b] = NULL;
+         }
+         shard->count = 0;
+      }
+      entry = (stat_entry_t*)malloc(sizeof(stat_entry_t));
+      entry->path = strdup(path);
+      entry->next = *bucket;
+      *bucket = entry;
+      shard->count++;
+   }
+   entry->rc = rc;
+   if (rc == 0)
+      entry->sbuf = *sbuf;
+   pthread_rwlock_unlock(&shard->lock);
+}
+
+//
+// stat()s path and remembers the result if it can be kept up to date
+//
+int statCacheStat(const char *path, struct stat *sbuf)
+{
+   unsigned int seen;
+   int rc;
+
+   if (shards == NULL)
+      return stat(path, sbuf);
+   metricsAdd(METRIC_STAT_MISSES, 1);
+   if (!statCacheable(path) || !statCacheWatched(path))
+      return stat(path, sbuf);
+
+   seen = atomic_load(&generation);
+   // a link may point out of the watched directories
+   if ((rc = lstat(path, sbuf)) == 0 && S_ISLNK(sbuf->st_mode))
+      return stat(path, sbuf);
+   if (rc < 0 && errno != ENOENT)
+      return rc;
+   statCachePut(path, rc, sbuf, seen);
+   return rc;
+}
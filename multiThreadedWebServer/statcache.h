@@ -0,0 +1,16 @@
+#ifndef __STATCACHE_H__
+#define __STATCACHE_H__
+
+#include <sys/stat.h>
+
+/* Returned by statCacheLookup for a path it knows nothing about */
+#define STAT_MISS -2
+
+/* Most paths remembered, 0 turns the cache off */
+extern int statcache_max;
+
+void statCacheInit(void);
+int statCacheLookup(const char *path, struct stat *sbuf);
+int statCacheStat(const char *path, struct stat *sbuf);
+
+#endif
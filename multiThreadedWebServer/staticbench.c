@@ -0,0 +1,163 @@
+/*
+ * staticbench.c: Compares the mmap and sendfile paths of requestServeStatic.
+ *
+ * For every file size a file of that size is created, then served
+ * repeatedly over a loopback TCP connection while a second thread drains
+ * the other end. Reports throughput and time per response for each mode.
+ *
+ * Usage: ./staticbench [size ...]   sizes like 1K, 1M, 1G (default 1K 1M 1G)
+ */
+#include "blg312e.h"
+#include "request.h"
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Bytes served per size and mode, so small files get many iterations */
+#define BENCH_BYTES (4LL << 30)
+#define MIN_ITERS 5
+#define MAX_ITERS 200000
+
+typedef struct {
+  int fd;
+  long long received;
+} drain_args_t;
+
+double now_seconds()
+{
+  struct timeval t;
+
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec / 1e6;
+}
+
+long long parse_size(char *s)
+{
+  char *end;
+  long long n = strtoll(s, &end, 10);
+
+  switch (*end) {
+  case 'G': case 'g': n <<= 10; /* fall through */
+  case 'M': case 'm': n <<= 10; /* fall through */
+  case 'K': case 'k': n <<= 10;
+  }
+  return n;
+}
+
+/*
+ * Creates a file of the given size filled with non-zero data
+ */
+void make_file(char *filename, long long size)
+{
+  char buf[MAXBUF];
+  long long left = size;
+  int fd, n;
+
+  memset(buf, 'x', sizeof(buf));
+  fd = Open(filename, O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE);
+  while (left > 0) {
+    n = left < sizeof(buf) ? left : sizeof(buf);
+    Write(fd, buf, n);
+    left -= n;
+  }
+  Close(fd);
+}
+
+void* drain(void *arg)
+{
+  drain_args_t *args = (drain_args_t*)arg;
+  char buf[1 << 16];
+  ssize_t n;
+
+  while ((n = read(args->fd, buf, sizeof(buf))) > 0)
+    args->received += n;
+  return NULL;
+}
+
+/*
+ * Serves filename iters times over a fresh loopback connection and returns
+ * the elapsed time, including the time the reader needs to drain it all
+ */
+double run(char *filename, int mode, int iters)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  drain_args_t args;
+  pthread_t reader;
+  request_t *request;
+  int listenfd, serverfd, i;
+  double start;
+
+  listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  Bind(listenfd, (SA *)&addr, sizeof(addr));
+  Listen(listenfd, 1);
+  if (getsockname(listenfd, (SA *)&addr, &addrlen) < 0)
+    unix_error("getsockname error");
+
+  args.fd = Socket(AF_INET, SOCK_STREAM, 0);
+  args.received = 0;
+  Connect(args.fd, (SA *)&addr, sizeof(addr));
+  serverfd = Accept(listenfd, NULL, NULL);
+  Close(listenfd);
+
+  request = requestNew(serverfd);
+  request->filename.ptr = filename;
+  request->filename.len = strlen(filename);
+  Stat(filename, &request->sbuf);
+
+  static_mode = mode;
+  pthread_create(&reader, NULL, drain, &args);
+
+  start = now_seconds();
+  for (i = 0; i < iters; i++) {
+    request->keep_alive = 1;
+    requestServeStatic(request);
+    if (!request->keep_alive)
+      app_error("send failed");
+  }
+  shutdown(serverfd, SHUT_WR);
+  pthread_join(reader, NULL);
+  double elapsed = now_seconds() - start;
+
+  Close(serverfd);
+  Close(args.fd);
+  requestFree(request);
+  return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+  char *defaults[] = {"1K", "1M", "1G"};
+  char **sizes = argc > 1 ? argv + 1 : defaults;
+  int nsizes = argc > 1 ? argc - 1 : 3;
+  char *modes[] = {"mmap", "sendfile"};
+  char filename[] = "/tmp/staticbench.XXXXXX";
+  int fd;
+
+  if ((fd = mkstemp(filename)) < 0)
+    unix_error("mkstemp error");
+  Close(fd);
+
+  printf("%10s %10s %10s %12s %14s\n", "size", "mode", "iters", "MB/s", "us/response");
+  for (int s = 0; s < nsizes; s++) {
+    long long size = parse_size(sizes[s]);
+    long long iters = BENCH_BYTES / (size > 0 ? size : 1);
+
+    if (iters < MIN_ITERS)
+      iters = MIN_ITERS;
+    if (iters > MAX_ITERS)
+      iters = MAX_ITERS;
+    make_file(filename, size);
+
+    for (int m = STATIC_MMAP; m <= STATIC_SENDFILE; m++) {
+      double elapsed = run(filename, m, iters);
+      printf("%10s %10s %10lld %12.1f %14.2f\n", sizes[s], modes[m], iters,
+             size * iters / elapsed / (1 << 20), elapsed * 1e6 / iters);
+    }
+  }
+  unlink(filename);
+  return 0;
+}
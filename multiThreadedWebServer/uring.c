@@ -0,0 +1,194 @@
+//
+// uring.c: The io_uring system calls, without liburing.
+//
+// Only built into the server with "make IO_URING=1". The rings are shared
+// with the kernel: we fill submission entries and move the tail, the
+// kernel fills completion entries and moves theirs, and the acquire and
+// release accesses make sure each side sees whole entries.
+//
+
+#ifdef USE_IO_URING
+
+#include "blg312e.h"
+#include "uring.h"
+#include <sys/syscall.h>
+
+static int uringSetup(unsigned entries, struct io_uring_params *p)
+{
+   return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+//
+// Sets up a ring with room for entries submissions. Returns -1 and sets
+// errno if the kernel does not offer io_uring, or does not allow it.
+//
+int uringInit(uring_t *ring, unsigned entries)
+{
+   struct io_uring_params p;
+   char *sq, *cq;
+
+   memset(ring, 0, sizeof(*ring));
+   memset(&p, 0, sizeof(p));
+   // only the event loop's thread submits, and it collects its completions
+   // itself, so the kernel need not interrupt it to run them
+   p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+   if ((ring->fd = uringSetup(entries, &p)) < 0 && errno == EINVAL) {
+      memset(&p, 0, sizeof(p));   // older kernel
+      ring->fd = uringSetup(entries, &p);
+   }
+   if (ring->fd < 0)
+      return -1;
+   ring->features = p.features;
+
+   // both rings share one mapping, as they have since Linux 5.4
+   ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ring->ring_size)
+      ring->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+      close(ring->fd);
+      errno = ENOSYS;
+      return -1;
+   }
+   sq = mmap(0, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             ring->fd, IORING_OFF_SQ_RING);
+   if (sq == MAP_FAILED) {
+      close(ring->fd);
+      return -1;
+   }
+   ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED) {
+      munmap(sq, ring->ring_size);
+      close(ring->fd);
+      return -1;
+   }
+   ring->ring = cq = sq;
+
+   ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+   ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+   ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+   ring->sq_entries = p.sq_entries;
+   ring->sq_local_tail = *ring->sq_tail;
+
+   ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+   ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+   ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+   return 0;
+}
+
+//
+// Registers fds as the ring's fixed files: submissions flagged with
+// IOSQE_FIXED_FILE name them by index, which saves the kernel looking the
+// file up and taking a reference on every operation
+//
+int uringRegisterFiles(uring_t *ring, int *fds, unsigned nfds)
+{
+   return (int)syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, nfds);
+}
+
+//
+// Moves the completions waiting in the ring to the held ones, which
+// uringPeek returns before any newer, so the kernel has room for more
+//
+static void uringHold(uring_t *ring)
+{
+   unsigned head = *ring->cq_head;
+   unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+   if (ring->held_count + (tail - head) > ring->held_cap) {
+      ring->held_cap = ring->held_count + (tail - head) + *ring->cq_mask + 1;
+      ring->held = (struct io_uring_cqe*)realloc(ring->held, ring->held_cap * sizeof(*ring->held));
+      if (ring->held == NULL)
+         unix_error("realloc error");
+   }
+   for (; head != tail; head++)
+      ring->held[ring->held_count++] = ring->cqes[head & *ring->cq_mask];
+   __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+//
+// Queues a submission and returns it for any further fields to be set.
+// data comes back with its completion. If the queue is full, what is in
+// it is submitted first, and if the completion queue is full too, its
+// completions are held for uringPeek until the kernel takes the batch.
+//
+struct io_uring_sqe *uringSqe(uring_t *ring, int op, int fd, void *addr, unsigned len, unsigned long long data)
+{
+   struct io_uring_sqe *sqe;
+   unsigned index;
+
+   while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+      if (uringEnter(ring, 0) < 0)
+         uringHold(ring);
+
+   index = ring->sq_local_tail & *ring->sq_mask;
+   sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = op;
+   sqe->fd = fd;
+   sqe->addr = (unsigned long)addr;
+   sqe->len = len;
+   sqe->user_data = data;
+   ring->sq_array[index] = index;
+   ring->sq_local_tail++;
+   return sqe;
+}
+
+//
+// Submits everything queued and waits until at least wait completions
+// are there to be peeked. Returns -1 if the completion queue is too full
+// for the kernel to take more; the caller reaps before trying again.
+//
+int uringEnter(uring_t *ring, unsigned wait)
+{
+   unsigned submit;
+   int rc;
+
+   __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+   // counted from the kernel's head, so entries an interrupted call left
+   // behind are submitted again
+   submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+   while ((rc = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                             wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+      if (errno == EINTR) {
+         submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+         continue;
+      }
+      if (errno == EBUSY || errno == EAGAIN)
+         return -1;
+      unix_error("io_uring_enter error");
+   }
+   return rc;
+}
+
+//
+// Returns the oldest completion not yet seen, or NULL
+//
+struct io_uring_cqe *uringPeek(uring_t *ring)
+{
+   unsigned head = *ring->cq_head;
+
+   if (ring->held_head < ring->held_count)
+      return &ring->held[ring->held_head];
+   if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      return NULL;
+   return &ring->cqes[head & *ring->cq_mask];
+}
+
+//
+// Hands the completion returned by uringPeek back to the kernel
+//
+void uringSeen(uring_t *ring)
+{
+   if (ring->held_head < ring->held_count) {
+      if (++ring->held_head == ring->held_count)
+         ring->held_head = ring->held_count = 0;
+      return;
+   }
+   __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, driven with the raw system calls. Submissions are
+ * only queued by uringSqe and reach the kernel with the next uringEnter,
+ * so a whole batch costs a single system call that also waits for the
+ * next completions.
+ */
+typedef struct {
+    int fd;
+    unsigned features;
+
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;   /* queued, not yet published to the kernel */
+    struct io_uring_sqe *sqes;
+
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* taken off a full completion queue so submitting could go on */
+    struct io_uring_cqe *held;
+    unsigned held_head, held_count, held_cap;
+
+    void *ring;
+    size_t ring_size, sqes_size;
+} uring_t;
+
+int uringInit(uring_t *ring, unsigned entries);
+int uringRegisterFiles(uring_t *ring, int *fds, unsigned nfds);
+struct io_uring_sqe *uringSqe(uring_t *ring, int op, int fd, void *addr, unsigned len, unsigned long long data);
+int uringEnter(uring_t *ring, unsigned wait);
+struct io_uring_cqe *uringPeek(uring_t *ring);
+void uringSeen(uring_t *ring);
+
+#endif
+
+#endif